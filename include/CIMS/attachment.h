@@ -0,0 +1,43 @@
+#ifndef CIMS_ATTACHMENT_H
+#define CIMS_ATTACHMENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* attachment macros */
+#define CIMS_ATTACHMENT_CHUNK (256 * 1024) /* bytes per ATTACH_DATA frame */
+#define CIMS_ATTACHMENT_RATE (4 * 1024 * 1024) /* default bytes per second and download */
+#define CIMS_ATTACHMENT_MAX_SIZE (1ll << 32) /* uploads may not reach past 4 GiB */
+/* attachment macros end */
+
+/* attachment types */
+typedef struct attachment_transfer *Attachment_Transfer;
+/* attachment types end */
+
+/* attachment functions */
+int attachment_valid_name(const char *name, size_t len);
+
+/* transfers are resumable, every call moves what the (non blocking) socket
+ * takes right now and returns the file bytes moved, 0 means try again later
+ * */
+
+/* uploads: the first bytes usually arrived together with the frame header
+ * (attachment_write), the rest never enters userspace (socket -> pipe -> file
+ * with splice)
+ * */
+Attachment_Transfer attachment_create(const char *name, off_t offset, size_t length);
+ssize_t attachment_write(Attachment_Transfer transfer, const void *buf, size_t len);
+ssize_t attachment_splice(Attachment_Transfer transfer, int sock_fd); /* at most one chunk per call */
+
+/* downloads are pumped chunk by chunk with sendfile, so the caller can serve
+ * other frames in between. length 0 means up to the end of the file
+ * */
+Attachment_Transfer attachment_open(const char *name, off_t offset, off_t length, size_t rate);
+ssize_t attachment_pump(Attachment_Transfer transfer, int sock_fd); /* -1 on errors */
+int attachment_mid_frame(Attachment_Transfer transfer); /* nothing else may be sent while TRUE */
+int attachment_wait_ms(Attachment_Transfer transfer); /* time until the next pump may send */
+int attachment_done(Attachment_Transfer transfer);
+void attachment_close(Attachment_Transfer transfer);
+/* attachment functions end */
+
+#endif /* CIMS_ATTACHMENT_H */
@@ -15,6 +15,7 @@
 /* CIMS types */
 struct env_data;
 #define Env_Data struct env_data *
+typedef struct cims_arena *Cims_Arena;
 #define SA struct sockaddr /* not to be used as a type but rather as a shorthand for (struct sockaddr *) casts */
 /* CIMS types end */
 
@@ -35,6 +36,9 @@ struct env_data;
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 
+#define CIMS_ARENA_CHUNK_SIZE (64 * 1024)
+#define CIMS_ARENA_ALIGN 16
+
 #define ASSERT_SYSCALL(sc)          \
             do {                    \
             if (sc < 0) {           \
@@ -60,6 +64,10 @@ struct env_data;
 #define CIMS_PATH "/etc/cims"
 #define CIMS_DATA_PATH CIMS_PATH "/data/"
 #define CIMS_SERVER_LOGFILE_PATH CIMS_DATA_PATH "server.log"
+#define CIMS_ATTACHMENT_PATH CIMS_DATA_PATH "attachments/"
+#define CIMS_MANIFEST_NAME ".manifest" /* inside CIMS_DATA_PATH, marks an initialized store */
+#define CIMS_MANIFEST_MAGIC "cims-data"
+#define CIMS_DATA_VERSION 1 /* bump to redo the setup of existing stores */
 /* cims data end */
 
 
@@ -71,7 +79,11 @@ void impl_cims_assert(char *expr, int eval, char *file, int line, char *function
 #define cims_assert(expr, ...) impl_cims_assert(#expr, (expr), __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
 
 struct stat get_program_stat(char **v);
-int cims_create_data_path(struct stat exec_stat);
+int cims_open_data_path(char **v); /* returns an fd of CIMS_DATA_PATH, set up if needed */
+int cims_create_data_path(struct stat exec_stat); /* FALSE if the chown had to be skipped */
+int cims_data_path_ready(int data_fd); /* the manifest is there and current */
+int cims_data_path_mark(int data_fd); /* write the manifest, atomically */
+int cims_chown_tree(int dir_fd, uid_t owner, gid_t group); /* takes ownership of dir_fd */
 int cims_open_logfile(FILE **logfile);
 int cims_export_env();
 /* cims functions end */
@@ -80,11 +92,23 @@ int cims_export_env();
 
 /* core functions */
 /* libc-like functions that don't give me headaches */
-int core_cims_mkpath(const char *s); /* recursively create a path */
+int core_cims_mkpath(const char *s); /* recursively create a path, -1 and errno on failure */
 void *core_cims_calloc(size_t chunk, size_t count); /* allocate a zero filled buffer */
 void core_cims_strncreat(char *buff, char **arr); /* create a string from array */
 char *core_cims_strtok(char *str, char *delim, int *offset, int len); /* tokenize a string */
 int core_cims_strcat(char *dst, char *src, int *offset, int len); /* append a string */
+
+/* bump pointer arena for request scoped memory. Nothing is freed on its own,
+ * a reset releases everything at once and hands the chunks to a per thread
+ * cache, so short lived allocations never touch malloc's locks.
+ * */
+Cims_Arena core_cims_arena_create();
+void *core_cims_arena_alloc(Cims_Arena arena, size_t size); /* NULL if size can't be satisfied */
+char *core_cims_arena_strdup(Cims_Arena arena, const char *s);
+char *core_cims_arena_printf(Cims_Arena arena, const char *fmt, ...) _printf(2, 3);
+char *core_cims_arena_vprintf(Cims_Arena arena, const char *fmt, va_list args);
+void core_cims_arena_reset(Cims_Arena arena);
+void core_cims_arena_destroy(Cims_Arena arena);
 /* core functions end */
 
 #endif /* CIMS_CIMS_H */
@@ -0,0 +1,42 @@
+#ifndef CIMS_COMPRESS_H
+#define CIMS_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <CIMS/cims.h>
+
+/* compress macros */
+#define CIMS_COMPRESS_MIN_SIZE (64) /* smaller payloads are never worth it */
+#define CIMS_COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+/* compress macros end */
+
+/* compress types */
+typedef struct payload *Payload;
+
+struct compress_stats {
+    uint64_t calls;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cpu_nsec;      /* thread cpu time spent inside cims_compress() */
+};
+/* compress types end */
+
+/* compress functions */
+/* LZ77 with a preset dictionary of common chat text. The match window is taken
+ * from arena. Returns the compressed size or -1 if the output would not fit
+ * into cap (E.g: incompressible input) or the window can't be allocated
+ * */
+ssize_t cims_compress(Cims_Arena arena, const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+ssize_t cims_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap);
+void cims_compress_stats(struct compress_stats *stats);
+
+/* a payload is compressed at most once, no matter to how many clients it is
+ * sent. It lives in the arena, so it stays valid until the arena is reset
+ * */
+Payload payload_create(Cims_Arena arena, const void *data, size_t len);
+/* returns the compressed form if allowed and worth it, the raw data otherwise */
+const void *payload_data(Payload payload, int allow_compressed, size_t *len, int *compressed);
+/* compress functions end */
+
+#endif /* CIMS_COMPRESS_H */
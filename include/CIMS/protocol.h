@@ -1,6 +1,71 @@
 #ifndef CIMS_PROTOCOL_H
 #define CIMS_PROTOCOL_H
 
+#include <stdint.h>
 
+/* protocol macros */
+#define CIMS_PROTOCOL_VERSION (1)
+#define CIMS_GREETING "connection successful!"
+#define CIMS_MAX_FRAME_SIZE (1 << 20)
 
-#endif /* CIMS_PROTOCOL_H */
\ No newline at end of file
+/* capabilities, negotiated with the HELLO frames */
+#define CIMS_CAP_COMPRESS (1 << 0)
+#define CIMS_CAP_BATCH (1 << 1)
+#define CIMS_SERVER_CAPS (CIMS_CAP_COMPRESS | CIMS_CAP_BATCH)
+
+/* frame flags */
+#define FRAME_COMPRESSED (1 << 0) /* payload is the raw length (uint32_t) followed by a cims_compress() stream */
+/* protocol macros end */
+
+/* protocol types */
+enum frame_type {
+    FRAME_HELLO = 1,
+    FRAME_MSG,          /* chat message, forwarded to every other client */
+    FRAME_ACK,          /* payload is the message id (uint64_t) or the stored attach_range */
+    FRAME_ERROR,        /* payload is a human readable reason */
+    FRAME_ATTACH_PUT,   /* attach_range, name, then length bytes of file data */
+    FRAME_ATTACH_GET,   /* attach_range, name. length 0 means up to the end of the file */
+    FRAME_ATTACH_DATA,  /* attach_range (no name), then length bytes of file data */
+    FRAME_RECEIPT,      /* payload is the id (uint64_t) of a message that was read */
+    FRAME_BATCH,        /* payload is a list of complete frames, no ATTACH_PUT or BATCH */
+};
+
+/* frames may be pipelined: a client doesn't have to wait for the reply of one
+ * frame before sending the next. All replies of one server loop iteration
+ * are sent together, a BATCH only saves the per frame headers on top.
+ * */
+
+/* every frame starts with this header, all fields are in network byte order.
+ * length is the size of the payload as it is on the wire (E.g: compressed)
+ * */
+struct frame_header {
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint16_t reserved;
+} __attribute__((packed));
+
+/* handshake:
+ *  server -> client : CIMS_GREETING followed by a HELLO frame with CIMS_SERVER_CAPS
+ *  client -> server : HELLO frame with the capabilities the client wants to use
+ *
+ * the client's HELLO is an ordinary frame, it may be pipelined with (or
+ * follow) other frames. Until it arrives no capability is used
+ * */
+struct hello_payload {
+    uint16_t version;
+    uint16_t caps;
+} __attribute__((packed));
+
+/* attachments move in chunks of at most CIMS_MAX_FRAME_SIZE, so chat frames can
+ * be interleaved with a running transfer. A PUT is acked with the range that
+ * was stored, an interrupted transfer resumes with a GET/PUT at that offset.
+ * */
+struct attach_range {
+    uint64_t offset;
+    uint64_t length;
+    uint16_t name_len;  /* bytes of name following the range, 0 for ATTACH_DATA */
+} __attribute__((packed));
+/* protocol types end */
+
+#endif /* CIMS_PROTOCOL_H */
@@ -7,6 +7,9 @@
 #include <errno.h>
 
 #define CIMS_BACKLOG 0xff
+#define CIMS_RX_BUFFER_SIZE (64 * 1024) /* grows up to one CIMS_MAX_FRAME_SIZE frame */
+#define CIMS_TX_IOV_MAX 64 /* replies queued before a write is forced */
+#define CIMS_TX_PENDING_MAX (4 * 1024 * 1024) /* unsent replies before a client is dropped */
 
 /* server types end */
 typedef struct server_info *Server_Info;
@@ -17,8 +20,8 @@ typedef struct client_info *Client_Info;
 /* server functions */
 Server_Info start_server();
 void stop_server(Server_Info server);
-void close_connection(Client_Info client);
-Client_Info accept_connection(Server_Info server);
+int serve_clients(Server_Info server); /* one poll() round, FALSE once a shutdown was requested */
+void broadcast_msg(Server_Info server, Client_Info sender, const void *msg, size_t len); /* to everyone but sender */
 /* server functions end */
 
 
@@ -0,0 +1,51 @@
+#ifndef CIMS_TRACE_H
+#define CIMS_TRACE_H
+
+#include <stdint.h>
+
+/* trace macros */
+#define CIMS_TRACE_RING_SIZE (4096) /* events per thread, has to be a power of two */
+#define CIMS_TRACE_MAX_THREADS (64)
+#define CIMS_TRACE_DUMP_SIGNAL SIGUSR1
+#define CIMS_TRACE_FILE_FMT "trace-%d-%u.json" /* pid, dump number */
+/* trace macros end */
+
+/* trace types */
+enum trace_stage {
+    TRACE_ACCEPT = 0,
+    TRACE_PARSE,
+    TRACE_ROUTE,
+    TRACE_PERSIST,
+    TRACE_WRITE,
+    TRACE_STAGE_COUNT,
+};
+
+/* the values double as the chrome trace "ph" field */
+enum trace_phase {
+    TRACE_BEGIN = 'B',
+    TRACE_END   = 'E',
+};
+/* trace types end */
+
+extern int cims_trace_active;
+
+/* a disabled tracepoint is a single (predicted) branch, nothing else. id is the
+ * connection for TRACE_ACCEPT and the message for every other stage
+ * */
+#define cims_trace(stage, phase, id)                                        \
+            do {                                                            \
+            if (__builtin_expect(cims_trace_active, 0))                     \
+                impl_cims_trace(stage, phase, id);                          \
+            } while (0)
+
+#define cims_trace_begin(stage, id) cims_trace(stage, TRACE_BEGIN, id)
+#define cims_trace_end(stage, id) cims_trace(stage, TRACE_END, id)
+
+/* trace functions */
+void impl_cims_trace(enum trace_stage stage, enum trace_phase phase, uint64_t id);
+void cims_trace_enable(); /* start recording and arm the dump signal */
+int cims_trace_poll(); /* dump the recorder if the dump signal was received */
+int cims_trace_dump(); /* write all rings to CIMS_DATA_PATH */
+/* trace functions end */
+
+#endif /* CIMS_TRACE_H */
@@ -0,0 +1,358 @@
+#define _GNU_SOURCE /* splice, pipe2 */
+#include <CIMS/cims.h>
+#include <CIMS/attachment.h>
+#include <CIMS/protocol.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+
+#define PIPE_CHUNK (64 * 1024) /* default pipe capacity */
+#define NSEC_PER_SEC 1000000000ull
+#define MSEC_PER_SEC 1000
+
+/* static function declarations start */
+static int get_attachment_dir();
+static int *get_thread_pipe();
+static void drop_thread_pipe();
+static void refill(Attachment_Transfer transfer);
+static size_t next_chunk(Attachment_Transfer transfer);
+static uint64_t now_ns();
+/* static function declarations end */
+
+struct attachment_transfer {
+    int fd;
+    off_t offset;       /* next byte to send or to store */
+    off_t end;
+    size_t rate;        /* bytes per second, 0 is unlimited */
+    size_t tokens;      /* bytes we may send right now */
+    uint64_t last_refill;
+    struct {
+        struct frame_header hdr;
+        struct attach_range range;
+    } __attribute__((packed)) head; /* of the ATTACH_DATA frame being sent */
+    size_t head_left;   /* bytes of head not sent yet */
+    size_t chunk_left;  /* file bytes of the current frame not sent yet */
+};
+
+static int attachment_dir = -1;
+static __thread int thread_pipe[2] = { -1, -1 };
+
+int attachment_valid_name(const char *name, size_t len)
+{
+    /* attachments live flat inside CIMS_ATTACHMENT_PATH, no way out of it */
+    if (len == 0 || len > NAME_MAX || name[0] == '.')
+        return FALSE;
+
+    for (size_t i = 0; i < len; ++i)
+        if (name[i] == '/' || name[i] == '\0')
+            return FALSE;
+
+    return TRUE;
+}
+
+Attachment_Transfer attachment_create(const char *name, off_t offset, size_t length)
+{
+    Attachment_Transfer transfer;
+    int dir = get_attachment_dir();
+    int fd;
+
+    if (dir < 0)
+        return NULL;
+
+    if (offset < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the range comes from the client, don't let it create huge sparse files */
+    if (offset > CIMS_ATTACHMENT_MAX_SIZE || length > CIMS_ATTACHMENT_MAX_SIZE - offset) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    if ((fd = openat(dir, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0640)) < 0)
+        return NULL;
+
+    transfer = core_cims_calloc(1, sizeof(struct attachment_transfer));
+    transfer->fd = fd;
+    transfer->offset = offset;
+    transfer->end = offset + length;
+
+    return transfer;
+}
+
+ssize_t attachment_write(Attachment_Transfer transfer, const void *buf, size_t len)
+{
+    size_t moved = 0;
+
+    while (moved < len) {
+        ssize_t rc = pwrite(transfer->fd, (const char *) buf + moved, len - moved, transfer->offset);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0)
+            return -1;
+
+        moved += rc;
+        transfer->offset += rc;
+    }
+
+    return moved;
+}
+
+ssize_t attachment_splice(Attachment_Transfer transfer, int sock_fd)
+{
+    int *pipe_fds = get_thread_pipe();
+    size_t moved = 0;
+
+    if (NULL == pipe_fds)
+        return -1;
+
+    /* one chunk per call, so a fast upload can't starve the other clients */
+    while (transfer->offset < transfer->end && moved < CIMS_ATTACHMENT_CHUNK) {
+        size_t left = transfer->end - transfer->offset;
+        size_t want = left < PIPE_CHUNK ? left : PIPE_CHUNK;
+        ssize_t in = splice(sock_fd, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (in < 0 && errno == EINTR)
+            continue;
+
+        if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (in <= 0) {
+            if (in == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+
+        while (in > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, transfer->fd, &transfer->offset, in, SPLICE_F_MOVE);
+
+            if (out < 0 && errno == EINTR)
+                continue;
+
+            if (out <= 0) {
+                /* whatever is left in the pipe belongs to this upload */
+                drop_thread_pipe();
+                return -1;
+            }
+
+            in -= out;
+            moved += out;
+        }
+    }
+
+    return moved;
+}
+
+Attachment_Transfer attachment_open(const char *name, off_t offset, off_t length, size_t rate)
+{
+    Attachment_Transfer transfer;
+    struct stat st;
+    int dir = get_attachment_dir();
+    int fd;
+
+    if (dir < 0)
+        return NULL;
+
+    if ((fd = openat(dir, name, O_RDONLY | O_CLOEXEC)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || offset < 0 || length < 0 || offset > st.st_size) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    transfer = core_cims_calloc(1, sizeof(struct attachment_transfer));
+    transfer->fd = fd;
+    transfer->offset = offset;
+    /* compared against what is left, offset + length may overflow */
+    transfer->end = (length && length < st.st_size - offset) ? offset + length : st.st_size;
+    transfer->rate = rate;
+    transfer->tokens = CIMS_ATTACHMENT_CHUNK; /* the first chunk goes out right away */
+    transfer->last_refill = now_ns();
+
+    return transfer;
+}
+
+ssize_t attachment_pump(Attachment_Transfer transfer, int sock_fd)
+{
+    size_t sent = 0;
+
+    if (!attachment_mid_frame(transfer)) {
+        size_t chunk = next_chunk(transfer);
+
+        refill(transfer);
+        if (transfer->rate && transfer->tokens < chunk)
+            return 0;
+
+        transfer->head.hdr = (struct frame_header) {
+            .length = htonl(sizeof(struct attach_range) + chunk),
+            .type   = FRAME_ATTACH_DATA,
+        };
+        transfer->head.range = (struct attach_range) {
+            .offset = htobe64(transfer->offset),
+            .length = htobe64(chunk),
+        };
+        transfer->head_left = sizeof(transfer->head);
+        transfer->chunk_left = chunk;
+
+        if (transfer->rate)
+            transfer->tokens -= chunk;
+    }
+
+    /* a full socket leaves the frame half sent, the next call continues it */
+    while (transfer->head_left > 0) {
+        const char *head = (const char *) &transfer->head + sizeof(transfer->head) - transfer->head_left;
+        ssize_t rc = send(sock_fd, head, transfer->head_left, MSG_MORE | MSG_NOSIGNAL);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        if (rc < 0)
+            return -1;
+
+        transfer->head_left -= rc;
+    }
+
+    while (transfer->chunk_left > 0) {
+        ssize_t rc = sendfile(sock_fd, transfer->fd, &transfer->offset, transfer->chunk_left);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+
+        if (rc <= 0) {
+            if (rc == 0)
+                errno = EIO; /* the file was truncated under us */
+            return -1;
+        }
+
+        transfer->chunk_left -= rc;
+        sent += rc;
+    }
+
+    return sent;
+}
+
+int attachment_mid_frame(Attachment_Transfer transfer)
+{
+    return transfer->head_left > 0 || transfer->chunk_left > 0;
+}
+
+int attachment_wait_ms(Attachment_Transfer transfer)
+{
+    size_t chunk = next_chunk(transfer);
+
+    refill(transfer);
+    if (attachment_mid_frame(transfer) || !transfer->rate || transfer->tokens >= chunk)
+        return 0;
+
+    /* round up, a too short wait would just spin */
+    return (chunk - transfer->tokens) * MSEC_PER_SEC / transfer->rate + 1;
+}
+
+int attachment_done(Attachment_Transfer transfer)
+{
+    return transfer->offset >= transfer->end && !attachment_mid_frame(transfer);
+}
+
+void attachment_close(Attachment_Transfer transfer)
+{
+    close(transfer->fd);
+    free(transfer);
+}
+
+static int get_attachment_dir()
+{
+    int dir = __atomic_load_n(&attachment_dir, __ATOMIC_ACQUIRE);
+    int expected = -1;
+
+    if (dir >= 0)
+        return dir;
+
+    if (mkdir(CIMS_ATTACHMENT_PATH, 0750) < 0 && errno != EEXIST)
+        return -1;
+
+    if ((dir = open(CIMS_ATTACHMENT_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+
+    /* another thread may have been faster */
+    if (!__atomic_compare_exchange_n(&attachment_dir, &expected, dir, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(dir);
+        dir = expected;
+    }
+
+    return dir;
+}
+
+static int *get_thread_pipe()
+{
+    if (thread_pipe[0] < 0 && pipe2(thread_pipe, O_CLOEXEC) < 0)
+        return NULL;
+
+    return thread_pipe;
+}
+
+static void drop_thread_pipe()
+{
+    close(thread_pipe[0]);
+    close(thread_pipe[1]);
+    thread_pipe[0] = thread_pipe[1] = -1;
+}
+
+/* token bucket, never holds more than one chunk so a download can't burst
+ * past the chat traffic of the same worker
+ * */
+static void refill(Attachment_Transfer transfer)
+{
+    uint64_t now = now_ns();
+    uint64_t earned;
+
+    if (!transfer->rate)
+        return;
+
+    /* in floating point, a long idle transfer would overflow the product */
+    earned = (double) (now - transfer->last_refill) * transfer->rate / NSEC_PER_SEC;
+    if (earned == 0)
+        return;
+
+    transfer->tokens += earned;
+    if (transfer->tokens > CIMS_ATTACHMENT_CHUNK)
+        transfer->tokens = CIMS_ATTACHMENT_CHUNK;
+    transfer->last_refill = now;
+}
+
+static size_t next_chunk(Attachment_Transfer transfer)
+{
+    off_t left = transfer->end - transfer->offset;
+
+    return left < CIMS_ATTACHMENT_CHUNK ? left : CIMS_ATTACHMENT_CHUNK;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
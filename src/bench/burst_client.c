@@ -0,0 +1,249 @@
+/* sends a burst of chat messages and counts the syscalls it takes
+ *
+ *  $ make bench
+ *  $ out/burst_client [serial|pipeline|batch] [frames] [port]
+ *
+ *  serial   : wait for every ack before the next message (one round trip each)
+ *  pipeline : write all messages at once, then read the acks
+ *  batch    : like pipeline, with up to BATCH_FRAMES messages per BATCH frame
+ *
+ * the server logs its side when the connection closes:
+ * "client N: X frames in Y syscalls"
+ * */
+#include <CIMS/cims.h>
+#include <CIMS/protocol.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_FRAMES 1000
+#define BATCH_FRAMES 64
+#define RX_SIZE (64 * 1024)
+#define NSEC_PER_SEC 1000000000ull
+#define NSEC_PER_USEC 1000
+
+enum burst_mode {
+    MODE_SERIAL = 0,
+    MODE_PIPELINE,
+    MODE_BATCH,
+};
+
+struct burst_client {
+    int fd;
+    uint8_t rx[RX_SIZE];
+    size_t rx_len;
+    uint64_t syscalls;
+    uint64_t round_trips;
+};
+
+/* static function declarations start */
+static void connect_server(struct burst_client *client, int port);
+static void send_all(struct burst_client *client, const void *buf, size_t len);
+static int read_frame(struct burst_client *client, struct frame_header *hdr, uint8_t *body, size_t cap);
+static size_t put_frame(uint8_t *buf, int type, const void *data, size_t len);
+static void wait_acks(struct burst_client *client, size_t count);
+static uint64_t now_ns();
+/* static function declarations end */
+
+static const char *mode_names[] = {
+    [MODE_SERIAL]   = "serial",
+    [MODE_PIPELINE] = "pipeline",
+    [MODE_BATCH]    = "batch",
+};
+
+static const char text[] = "on my way, see you in a minute";
+
+int main(int argc, char **argv)
+{
+    struct burst_client *client = core_cims_calloc(1, sizeof(struct burst_client));
+    enum burst_mode mode = MODE_PIPELINE;
+    size_t frames = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_FRAMES;
+    int port = argc > 3 ? atoi(argv[3]) : CIMS_PORT;
+    size_t frame_size = sizeof(struct frame_header) + sizeof(text) - NULL_TERM_SIZE;
+    uint8_t *out = malloc(frames * frame_size + (frames / BATCH_FRAMES + 1) * sizeof(struct frame_header));
+    size_t out_len = 0;
+    uint64_t start;
+
+    if (argc > 1) {
+        for (mode = MODE_SERIAL; mode < ARRAY_SIZE(mode_names); ++mode)
+            if (!strcmp(argv[1], mode_names[mode]))
+                break;
+        cims_assert(mode < ARRAY_SIZE(mode_names), "usage: %s [serial|pipeline|batch] [frames] [port]", argv[0]);
+    }
+    cims_assert(frames > 0 && NULL != out, "usage: %s [serial|pipeline|batch] [frames] [port]", argv[0]);
+
+    connect_server(client, port);
+    client->syscalls = 0; /* only the burst is measured */
+
+    start = now_ns();
+    switch (mode) {
+    case MODE_SERIAL:
+        for (size_t i = 0; i < frames; ++i) {
+            out_len = put_frame(out, FRAME_MSG, text, sizeof(text) - NULL_TERM_SIZE);
+            send_all(client, out, out_len);
+            wait_acks(client, 1);
+            client->round_trips++;
+        }
+        break;
+    case MODE_PIPELINE:
+        for (size_t i = 0; i < frames; ++i)
+            out_len += put_frame(out + out_len, FRAME_MSG, text, sizeof(text) - NULL_TERM_SIZE);
+        send_all(client, out, out_len);
+        wait_acks(client, frames);
+        client->round_trips++;
+        break;
+    case MODE_BATCH:
+        for (size_t i = 0; i < frames; i += BATCH_FRAMES) {
+            size_t inner = frames - i < BATCH_FRAMES ? frames - i : BATCH_FRAMES;
+            size_t batch_start = out_len;
+
+            out_len += sizeof(struct frame_header);
+            for (size_t j = 0; j < inner; ++j)
+                out_len += put_frame(out + out_len, FRAME_MSG, text, sizeof(text) - NULL_TERM_SIZE);
+
+            /* the batch header goes in front once its length is known */
+            put_frame(out + batch_start, FRAME_BATCH, NULL, out_len - batch_start - sizeof(struct frame_header));
+        }
+        send_all(client, out, out_len);
+        wait_acks(client, frames);
+        client->round_trips++;
+        break;
+    }
+
+    printf("%s: %zu messages, %llu round trips, %llu client syscalls (%.2f per message), %.1f us\n",
+           mode_names[mode], frames, (unsigned long long) client->round_trips,
+           (unsigned long long) client->syscalls, (double) client->syscalls / frames,
+           (double) (now_ns() - start) / NSEC_PER_USEC);
+
+    close(client->fd);
+    free(out);
+    free(client);
+
+    return EXIT_SUCCESS;
+}
+
+static void connect_server(struct burst_client *client, int port)
+{
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+        .sin_addr   = { inet_addr("127.0.0.1") },
+    };
+    char greeting[sizeof(CIMS_GREETING) - NULL_TERM_SIZE];
+    struct hello_payload hello = {
+        .version    = htons(CIMS_PROTOCOL_VERSION),
+        .caps       = htons(CIMS_CAP_BATCH),
+    };
+    struct frame_header hdr;
+    uint8_t buf[sizeof(hello) + sizeof(hdr)];
+
+    client->fd = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_SYSCALL(client->fd);
+    cims_assert(connect(client->fd, (struct sockaddr *) &address, sizeof(address)) == 0,
+                "cannot connect to port %d: %s", port, strerror(errno));
+
+    /* the greeting has no frame header */
+    while (client->rx_len < sizeof(greeting)) {
+        ssize_t rc = recv(client->fd, client->rx + client->rx_len, RX_SIZE - client->rx_len, 0);
+
+        cims_assert(rc > 0, "no greeting from the server");
+        client->rx_len += rc;
+    }
+    memcpy(greeting, client->rx, sizeof(greeting));
+    client->rx_len -= sizeof(greeting);
+    memmove(client->rx, client->rx + sizeof(greeting), client->rx_len);
+
+    cims_assert(read_frame(client, &hdr, buf, sizeof(buf)) == FRAME_HELLO, "no HELLO from the server");
+    send_all(client, buf, put_frame(buf, FRAME_HELLO, &hello, sizeof(hello)));
+}
+
+static void send_all(struct burst_client *client, const void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t rc = send(client->fd, buf, len, MSG_NOSIGNAL);
+
+        client->syscalls++;
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        cims_assert(rc > 0, "send failed: %s", strerror(errno));
+        buf = (const uint8_t *) buf + rc;
+        len -= rc;
+    }
+}
+
+/* returns the frame type, the body is cut to cap */
+static int read_frame(struct burst_client *client, struct frame_header *hdr, uint8_t *body, size_t cap)
+{
+    size_t len;
+
+    for (;;) {
+        ssize_t rc;
+
+        if (client->rx_len >= sizeof(*hdr)) {
+            memcpy(hdr, client->rx, sizeof(*hdr));
+            len = sizeof(*hdr) + ntohl(hdr->length);
+            cims_assert(len <= RX_SIZE, "frame of %zu bytes", len);
+
+            if (client->rx_len >= len)
+                break;
+        }
+
+        rc = recv(client->fd, client->rx + client->rx_len, RX_SIZE - client->rx_len, 0);
+        client->syscalls++;
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+        cims_assert(rc > 0, "connection lost: %s", rc == 0 ? "closed" : strerror(errno));
+        client->rx_len += rc;
+    }
+
+    memcpy(body, client->rx + sizeof(*hdr), len - sizeof(*hdr) < cap ? len - sizeof(*hdr) : cap);
+    client->rx_len -= len;
+    memmove(client->rx, client->rx + len, client->rx_len);
+
+    return hdr->type;
+}
+
+static size_t put_frame(uint8_t *buf, int type, const void *data, size_t len)
+{
+    struct frame_header hdr = {
+        .length = htonl(len),
+        .type   = type,
+    };
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    if (NULL != data)
+        memcpy(buf + sizeof(hdr), data, len);
+
+    return sizeof(hdr) + len;
+}
+
+static void wait_acks(struct burst_client *client, size_t count)
+{
+    struct frame_header hdr;
+    uint8_t body[sizeof(uint64_t)];
+
+    while (count > 0) {
+        int type = read_frame(client, &hdr, body, sizeof(body));
+
+        cims_assert(type == FRAME_ACK, "expected an ACK, got frame type %d", type);
+        count--;
+    }
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
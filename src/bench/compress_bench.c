@@ -0,0 +1,256 @@
+/* compression ratio and cpu cost of the chat codec
+ *
+ *  $ make bench
+ *  $ out/compress_bench [messages.txt]
+ *
+ * without a file a synthetic corpus of chat messages is used, otherwise every
+ * line of the file is one message
+ * */
+#include <CIMS/cims.h>
+#include <CIMS/compress.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CORPUS_SIZE 10000
+#define HISTORY_LEN 50      /* messages per history replay */
+#define FANOUT 100          /* recipients of one message */
+#define MSG_MAX 4096
+#define NSEC_PER_SEC 1000000000ull
+
+/* static function declarations start */
+static size_t load_corpus(const char *path, char **corpus, size_t max);
+static size_t make_corpus(char **corpus, size_t count);
+static void bench_single(char **corpus, size_t count);
+static void bench_history(char **corpus, size_t count);
+static void bench_fanout(char **corpus, size_t count);
+static uint64_t cpu_clock();
+static uint32_t next_rand();
+/* static function declarations end */
+
+static const char *names[] = { "alice", "bob", "carol", "dave", "erin", "mallory", "trent" };
+static const char *texts[] = {
+    "hi", "ok", "lol", "thanks!", "see you later", "on my way",
+    "hey how are you", "I'm fine thanks, and you?", "sounds good let me know",
+    "did you see the message I sent you this morning?",
+    "can you send me the file from the meeting, I think it is the one from tomorrow",
+    "https://www.example.com/photos/holiday.jpg",
+    "good morning! the meeting is at 10, I will call you back in a minute",
+    "I don't know, what are you doing tonight? we could get pizza at the usual place",
+};
+static uint32_t rand_state = 4035;
+
+int main(int argc, char **argv)
+{
+    char **corpus = calloc(CORPUS_SIZE, sizeof(char *));
+    size_t count;
+
+    cims_assert(NULL != corpus, "out of memory");
+
+    if (argc > 1)
+        count = load_corpus(argv[1], corpus, CORPUS_SIZE);
+    else
+        count = make_corpus(corpus, CORPUS_SIZE);
+
+    cims_assert(count > 0, "empty corpus");
+    printf("corpus: %zu messages%s\n\n", count, argc > 1 ? "" : " (synthetic)");
+
+    bench_single(corpus, count);
+    bench_history(corpus, count);
+    bench_fanout(corpus, count);
+
+    for (size_t i = 0; i < count; ++i)
+        free(corpus[i]);
+    free(corpus);
+
+    return EXIT_SUCCESS;
+}
+
+static size_t load_corpus(const char *path, char **corpus, size_t max)
+{
+    FILE *file = fopen(path, "r");
+    char line[MSG_MAX];
+    size_t count = 0;
+
+    cims_assert(NULL != file, "cannot open \"%s\"", path);
+
+    while (count < max && NULL != fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0')
+            corpus[count++] = strdup(line);
+    }
+
+    fclose(file);
+    return count;
+}
+
+/* a mix of bare texts and the json envelopes clients wrap them in */
+static size_t make_corpus(char **corpus, size_t count)
+{
+    char msg[MSG_MAX];
+
+    for (size_t i = 0; i < count; ++i) {
+        const char *text = texts[next_rand() % ARRAY_SIZE(texts)];
+
+        if (next_rand() % 4 == 0) {
+            snprintf(msg, sizeof(msg), "%s", text);
+        } else {
+            snprintf(msg, sizeof(msg),
+                     "{\"type\":\"message\",\"id\":\"%u\",\"from\":\"%s\",\"to\":\"%s\","
+                     "\"text\":\"%s\",\"timestamp\":%u}",
+                     next_rand(), names[next_rand() % ARRAY_SIZE(names)],
+                     names[next_rand() % ARRAY_SIZE(names)], text, 1700000000 + next_rand() % 1000000);
+        }
+
+        corpus[i] = strdup(msg);
+    }
+
+    return count;
+}
+
+/* every message on its own, exactly like the server sends them */
+static void bench_single(char **corpus, size_t count)
+{
+    Cims_Arena arena = core_cims_arena_create();
+    uint8_t out[MSG_MAX];
+    size_t raw = 0, wire = 0, packed = 0;
+    uint64_t start, compress_ns, decompress_ns = 0;
+
+    start = cpu_clock();
+    for (size_t i = 0; i < count; ++i) {
+        Payload payload = payload_create(arena, corpus[i], strlen(corpus[i]));
+        size_t len;
+        int compressed;
+
+        payload_data(payload, TRUE, &len, &compressed);
+        raw += strlen(corpus[i]);
+        wire += len;
+        packed += compressed;
+        core_cims_arena_reset(arena);
+    }
+    compress_ns = cpu_clock() - start;
+
+    /* round trip, so a broken codec can't report a good ratio */
+    for (size_t i = 0; i < count; ++i) {
+        Payload payload = payload_create(arena, corpus[i], strlen(corpus[i]));
+        const uint8_t *data;
+        size_t len;
+        int compressed;
+
+        data = payload_data(payload, TRUE, &len, &compressed);
+        if (compressed) {
+            start = cpu_clock();
+            cims_assert(cims_decompress(data + sizeof(uint32_t), len - sizeof(uint32_t), out, sizeof(out))
+                        == (ssize_t) strlen(corpus[i]), "round trip of message %zu failed", i);
+            decompress_ns += cpu_clock() - start;
+            cims_assert(!memcmp(out, corpus[i], strlen(corpus[i])), "round trip of message %zu failed", i);
+        }
+        core_cims_arena_reset(arena);
+    }
+
+    printf("single messages\n");
+    printf("\t%zu -> %zu bytes on the wire (ratio %.2f), %zu of %zu compressed\n",
+           raw, wire, (double) raw / wire, packed, count);
+    printf("\tcompress %.2f us, decompress %.2f us per message (cpu)\n\n",
+           (double) compress_ns / count / 1000, packed ? (double) decompress_ns / packed / 1000 : 0.0);
+
+    core_cims_arena_destroy(arena);
+}
+
+/* a client catching up gets the last messages as one payload */
+static void bench_history(char **corpus, size_t count)
+{
+    Cims_Arena arena = core_cims_arena_create();
+    size_t cap = HISTORY_LEN * MSG_MAX + 64;
+    char *history = malloc(cap);
+    uint8_t *out = malloc(CIMS_COMPRESS_BOUND(cap));
+    size_t raw = 0, packed = 0, replays = 0;
+    uint64_t start, cpu_ns = 0;
+
+    cims_assert(NULL != history && NULL != out, "out of memory");
+
+    for (size_t first = 0; first + HISTORY_LEN <= count; first += HISTORY_LEN, ++replays) {
+        size_t len = snprintf(history, cap, "{\"history\":[");
+        ssize_t rc;
+
+        for (size_t i = first; i < first + HISTORY_LEN; ++i)
+            len += snprintf(history + len, cap - len, "%s%s", i == first ? "" : ",", corpus[i]);
+        len += snprintf(history + len, cap - len, "]}");
+
+        start = cpu_clock();
+        rc = cims_compress(arena, (uint8_t *) history, len, out, CIMS_COMPRESS_BOUND(cap));
+        cpu_ns += cpu_clock() - start;
+        core_cims_arena_reset(arena);
+
+        cims_assert(rc >= 0, "history didn't fit the bound");
+        raw += len;
+        packed += rc;
+    }
+
+    if (replays > 0) {
+        printf("history replay (%d messages each)\n", HISTORY_LEN);
+        printf("\t%zu -> %zu bytes (ratio %.2f), %.2f us per replay (cpu)\n\n",
+               raw, packed, (double) raw / packed, (double) cpu_ns / replays / 1000);
+    }
+
+    free(out);
+    free(history);
+    core_cims_arena_destroy(arena);
+}
+
+/* one message to FANOUT recipients: compressed per recipient vs once per payload */
+static void bench_fanout(char **corpus, size_t count)
+{
+    Cims_Arena arena = core_cims_arena_create();
+    uint8_t out[MSG_MAX];
+    uint64_t start, per_recipient_ns, per_payload_ns;
+    size_t sent = count < 1000 ? count : 1000;
+
+    start = cpu_clock();
+    for (size_t i = 0; i < sent; ++i) {
+        size_t len = strlen(corpus[i]);
+
+        for (int r = 0; r < FANOUT && len >= CIMS_COMPRESS_MIN_SIZE; ++r)
+            cims_compress(arena, (uint8_t *) corpus[i], len, out, len);
+        core_cims_arena_reset(arena);
+    }
+    per_recipient_ns = cpu_clock() - start;
+
+    start = cpu_clock();
+    for (size_t i = 0; i < sent; ++i) {
+        Payload payload = payload_create(arena, corpus[i], strlen(corpus[i]));
+        size_t len;
+        int compressed;
+
+        for (int r = 0; r < FANOUT; ++r)
+            payload_data(payload, TRUE, &len, &compressed);
+        core_cims_arena_reset(arena);
+    }
+    per_payload_ns = cpu_clock() - start;
+
+    printf("fan-out (%zu messages to %d recipients)\n", sent, FANOUT);
+    printf("\tcompress per recipient %.2f ms, once per payload %.2f ms (cpu)\n",
+           (double) per_recipient_ns / 1000000, (double) per_payload_ns / 1000000);
+
+    core_cims_arena_destroy(arena);
+}
+
+static uint64_t cpu_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* xorshift, the synthetic corpus is the same on every run */
+static uint32_t next_rand()
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+
+    return rand_state;
+}
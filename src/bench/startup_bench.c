@@ -0,0 +1,150 @@
+/* startup cost of the data path against the size of the store
+ *
+ *  $ make bench
+ *  $ out/startup_bench [max_files]
+ *
+ * for every size a scratch store is built in /tmp and timed twice: the full
+ * walk (the old startup on every start, now only the first setup) and the
+ * manifest check every later start does
+ * */
+#include <CIMS/cims.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define FILES_PER_DIR 1000
+#define DEFAULT_MAX_FILES 100000
+#define CHECK_RUNS 1000
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_SEC 1000000000ull
+
+/* static function declarations start */
+static void build_store(int data_fd, size_t files);
+static void remove_tree(int dir_fd);
+static uint64_t now_ns();
+/* static function declarations end */
+
+int main(int argc, char **argv)
+{
+    size_t max_files = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_MAX_FILES;
+    char root[] = "/tmp/cims-startup-XXXXXX";
+
+    cims_assert(max_files > 0, "usage: %s [max_files]", argv[0]);
+    cims_assert(NULL != mkdtemp(root), "cannot create a scratch directory: %s", strerror(errno));
+
+    printf("%10s %16s %16s\n", "files", "full walk (us)", "manifest (us)");
+
+    for (size_t files = 100; files <= max_files; files *= 10) {
+        int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int data_fd;
+        uint64_t start, walk_ns, check_ns;
+
+        ASSERT_SYSCALL(root_fd);
+        ASSERT_SYSCALL(mkdirat(root_fd, "data", 0750));
+        data_fd = openat(root_fd, "data", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        ASSERT_SYSCALL(data_fd);
+
+        build_store(data_fd, files);
+
+        /* chowning to ourselves touches every inode without needing root */
+        start = now_ns();
+        cims_assert(cims_chown_tree(fcntl(data_fd, F_DUPFD_CLOEXEC, 0), geteuid(), getegid()),
+                    "walk failed: %s", strerror(errno));
+        cims_assert(cims_data_path_mark(data_fd), "cannot write the manifest: %s", strerror(errno));
+        walk_ns = now_ns() - start;
+
+        start = now_ns();
+        for (int i = 0; i < CHECK_RUNS; ++i) {
+            int fd = openat(root_fd, "data", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            cims_assert(fd >= 0 && cims_data_path_ready(fd), "manifest check failed");
+            close(fd);
+        }
+        check_ns = (now_ns() - start) / CHECK_RUNS;
+
+        printf("%10zu %16.1f %16.1f\n", files,
+               (double) walk_ns / NSEC_PER_USEC, (double) check_ns / NSEC_PER_USEC);
+        fflush(stdout);
+
+        /* takes data_fd, the next size starts from an empty store */
+        remove_tree(data_fd);
+        ASSERT_SYSCALL(unlinkat(root_fd, "data", AT_REMOVEDIR));
+        close(root_fd);
+    }
+
+    ASSERT_SYSCALL(rmdir(root));
+    return EXIT_SUCCESS;
+}
+
+/* small files spread over sub directories, like message segments */
+static void build_store(int data_fd, size_t files)
+{
+    char name[32];
+    int dir_fd = -1;
+
+    for (size_t i = 0; i < files; ++i) {
+        int fd;
+
+        if (i % FILES_PER_DIR == 0) {
+            if (dir_fd >= 0)
+                close(dir_fd);
+            snprintf(name, sizeof(name), "segments-%zu", i / FILES_PER_DIR);
+            ASSERT_SYSCALL(mkdirat(data_fd, name, 0750));
+            dir_fd = openat(data_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            ASSERT_SYSCALL(dir_fd);
+        }
+
+        snprintf(name, sizeof(name), "%zu", i);
+        fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+        ASSERT_SYSCALL(fd);
+        ASSERT_SYSCALL(write(fd, name, strlen(name)));
+        close(fd);
+    }
+
+    if (dir_fd >= 0)
+        close(dir_fd);
+}
+
+/* empties the directory, takes ownership of dir_fd */
+static void remove_tree(int dir_fd)
+{
+    DIR *dir_ptr = fdopendir(dir_fd);
+    struct dirent *entry;
+
+    cims_assert(NULL != dir_ptr, "cannot read the scratch store: %s", strerror(errno));
+    /* a dup of the fd (E.g: the one the walk got) shares its position */
+    rewinddir(dir_ptr);
+
+    while (NULL != (entry = readdir(dir_ptr))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        if (entry->d_type == DT_DIR) {
+            int sub_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+            ASSERT_SYSCALL(sub_fd);
+            remove_tree(sub_fd);
+            ASSERT_SYSCALL(unlinkat(dir_fd, entry->d_name, AT_REMOVEDIR));
+        } else {
+            ASSERT_SYSCALL(unlinkat(dir_fd, entry->d_name, 0));
+        }
+    }
+
+    closedir(dir_ptr);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
@@ -7,13 +7,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 #define ROOT_UID 0
 
 /* static function declarations start */
-static ssize_t recursive_chown(char *dir_path, uid_t owner, gid_t group);
 static int is_delim(char c, char *delim, int len);
+static struct arena_chunk *arena_chunk_get();
 /* static function declarations end */
 
 struct env_data {
@@ -37,40 +39,85 @@ void impl_cims_assert(char *expr, int eval, char *file, int line, char *function
     }
 }
 
-int has_data_path()
+struct stat get_program_stat(char **v)
 {
-    struct stat data_path_stat;
+    struct stat exec_stat;
+    Cims_Arena arena = core_cims_arena_create();
+    long path_max = pathconf("/", _PC_PATH_MAX);
+    char *real_program_path;
 
-    if (stat(CIMS_DATA_PATH, &data_path_stat) < 0) {
-        return !(errno == ENOENT);
-    }
+    /* pathconf() is -1 if there is no limit */
+    real_program_path = core_cims_arena_alloc(arena, path_max > 0 ? path_max : PATH_MAX);
+    cims_assert(NULL != real_program_path, "out of memory");
 
+    /* v[0] doesn't resolve if we were started through a PATH lookup */
+    if (NULL == realpath(v[0], real_program_path))
+        strcpy(real_program_path, "/proc/self/exe");
 
+    ASSERT_SYSCALL(stat(real_program_path, &exec_stat));
+
+    core_cims_arena_destroy(arena);
+    return exec_stat;
 }
 
-struct stat get_program_stat(char **v)
+
+/* opens CIMS_DATA_PATH, initializing it only if it has no (current) manifest.
+ * A store that was set up before costs an open and a read, no matter its size.
+ * */
+int cims_open_data_path(char **v)
 {
-    struct stat exec_stat;
-    char *real_program_path = malloc(pathconf(v[0], _PC_PATH_MAX));
+    int data_fd = open(CIMS_DATA_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int complete;
 
-    realpath(v[0], real_program_path);
-    ASSERT_SYSCALL(stat(real_program_path, &exec_stat));
+    if (data_fd >= 0 && cims_data_path_ready(data_fd))
+        return data_fd;
 
-    free(real_program_path);
-    return exec_stat;
-}
+    if (data_fd >= 0)
+        close(data_fd);
 
+    complete = cims_create_data_path(get_program_stat(v));
+
+    data_fd = open(CIMS_DATA_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cims_assert(data_fd >= 0, "cannot open \"%s\": %s", CIMS_DATA_PATH, strerror(errno));
+
+    /* without the chown the manifest would make every later start (E.g: as
+     * root) skip the setup for good, so it is redone until it succeeded
+     * */
+    if (!complete) {
+        fprintf(stderr, "[CIMS] not the owner of the executable, \"%s\" was not chowned\n", CIMS_PATH);
+        return data_fd;
+    }
+
+    /* written last, an interrupted setup is simply redone on the next start */
+    cims_assert(cims_data_path_mark(data_fd), "cannot write the data manifest: %s", strerror(errno));
+
+    return data_fd;
+}
 
 int cims_create_data_path(struct stat exec_stat)
 {
+    int root_fd;
 
-    /* now we actually need the user to be root */
-    cims_assert(geteuid() == ROOT_UID, "please rerun as superuser!");
+    if (core_cims_mkpath(CIMS_DATA_PATH) < 0) {
+        /* only now we actually need the user to be root */
+        cims_assert(errno != EACCES || geteuid() == ROOT_UID, "please rerun as superuser!");
+        cims_assert(FALSE, "cannot create \"%s\": %s", CIMS_DATA_PATH, strerror(errno));
+    }
+
+    /* we want the owner of the executable to have full permissions. Without
+     * root that only works (and is only needed) if we are that owner
+     * */
+    if (geteuid() != ROOT_UID && geteuid() != exec_stat.st_uid)
+        return FALSE;
+
+    root_fd = open(CIMS_PATH, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cims_assert(root_fd >= 0, "cannot open \"%s\": %s", CIMS_PATH, strerror(errno));
 
-    core_cims_mkpath(CIMS_DATA_PATH);
+    /* NOTE: the program WILL fail if either the opening or modifying fails */
+    cims_assert(cims_chown_tree(root_fd, exec_stat.st_uid, exec_stat.st_gid),
+                "cannot chown \"%s\": %s", CIMS_PATH, strerror(errno));
 
-    /* we want the owner of the executable to have full permissions */
-    recursive_chown(CIMS_PATH, exec_stat.st_uid, exec_stat.st_gid);
+    return TRUE;
 }
 
 int cims_open_logfile(FILE **logfile)
@@ -87,34 +134,82 @@ int cims_export_env()
     return TRUE;
 }
 
-static ssize_t recursive_chown(char *dir_path, uid_t owner, gid_t group)
+/* walks the tree with fd relative calls, so no path is ever built. Takes
+ * ownership of dir_fd
+ * */
+int cims_chown_tree(int dir_fd, uid_t owner, gid_t group)
 {
     DIR *dir_ptr;
     struct dirent *entry;
+    int ok = TRUE;
 
-    dir_ptr = opendir(dir_path);
+    if (fchown(dir_fd, owner, group) < 0 || NULL == (dir_ptr = fdopendir(dir_fd))) {
+        close(dir_fd);
+        return FALSE;
+    }
 
-    /* NOTE: the program WILL fail if either the opening or modifying fails */
-    cims_assert(NULL != dir_ptr, "cannot open DIR \"%s\" for chown", dir_path);
+    while (ok && NULL != (entry = readdir(dir_ptr))) {
+        int sub_fd;
 
-    ASSERT_SYSCALL(chown(dir_path, owner, group));
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
 
-    while (NULL != (entry = readdir(dir_ptr))) {
-        if (entry->d_name[0] == '.')
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+            ok = fchownat(dir_fd, entry->d_name, owner, group, AT_SYMLINK_NOFOLLOW) == 0;
             continue;
-        printf("directory %s\n", entry->d_name);
-        if (entry->d_type == DT_DIR) {
-            char *sub_dir = malloc(pathconf(dir_path, _PC_PATH_MAX));
-            /* append the directory name to the path and execute the function again */
-            core_cims_strncreat(sub_dir, (char *[]) {dir_path, "/", entry->d_name, NULL});
-
-            printf("sub_dir chown %s\n", sub_dir);
-            recursive_chown(sub_dir, owner, group);
-            free(sub_dir);
         }
+
+        /* O_NOFOLLOW, a symlink is chowned itself and not walked into */
+        sub_fd = openat(dir_fd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd >= 0)
+            ok = cims_chown_tree(sub_fd, owner, group);
+        else if (errno == ENOTDIR || errno == ELOOP)
+            ok = fchownat(dir_fd, entry->d_name, owner, group, AT_SYMLINK_NOFOLLOW) == 0;
+        else
+            ok = FALSE;
     }
 
     closedir(dir_ptr);
+    return ok;
+}
+
+int cims_data_path_ready(int data_fd)
+{
+    char buf[sizeof(CIMS_MANIFEST_MAGIC) + 16];
+    unsigned int version;
+    ssize_t len;
+    int fd = openat(data_fd, CIMS_MANIFEST_NAME, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return FALSE;
+
+    len = read(fd, buf, sizeof(buf) - NULL_TERM_SIZE);
+    close(fd);
+
+    if (len <= 0)
+        return FALSE;
+    NULL_TERM_BUFF(buf, len);
+
+    return sscanf(buf, CIMS_MANIFEST_MAGIC " %u", &version) == 1 && version == CIMS_DATA_VERSION;
+}
+
+int cims_data_path_mark(int data_fd)
+{
+    char buf[sizeof(CIMS_MANIFEST_MAGIC) + 16];
+    int len = snprintf(buf, sizeof(buf), CIMS_MANIFEST_MAGIC " %u\n", CIMS_DATA_VERSION);
+    int fd = openat(data_fd, CIMS_MANIFEST_NAME ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return FALSE;
+
+    if (write(fd, buf, len) != len || fsync(fd) < 0) {
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
+
+    /* atomic, a crash leaves either no manifest or a complete one */
+    return renameat(data_fd, CIMS_MANIFEST_NAME ".tmp", data_fd, CIMS_MANIFEST_NAME) == 0;
 }
 
 static int is_delim(char c, char *delim, int len)
@@ -201,12 +296,15 @@ void *core_cims_calloc(size_t chunk, size_t count)
 
 int core_cims_mkpath(const char *s)
 {
+    Cims_Arena arena    = core_cims_arena_create();
     size_t len          = strlen(s);
     size_t path_offset  = 0;
     size_t str_offset   = 0;
-    char *copy          = strdup(s);
+    char *copy          = core_cims_arena_strdup(arena, s);
     char *sub_dir       = NULL;
-    char *path_buf      = core_cims_calloc(sizeof(char), len + NULL_TERM_SIZE);
+    char *path_buf      = core_cims_arena_alloc(arena, len + NULL_TERM_SIZE);
+
+    NULL_TERM_BUFF(path_buf, 0);
 
     while (NULL != (sub_dir = core_cims_strtok(copy, "/", &path_offset, len))) {
 
@@ -219,16 +317,173 @@ int core_cims_mkpath(const char *s)
                 errno = 0;
                 continue;
             } else {
-                perror("mkdir");
-                exit(EXIT_FAILURE);
+                int err = errno;
+                core_cims_arena_destroy(arena);
+                errno = err;
+                return -1;
             }
         }
     }
 
-    free(path_buf);
-    free(copy);
+    core_cims_arena_destroy(arena);
 
 
     return 0;
 }
 
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;            /* usable bytes in data */
+    char data[];
+};
+
+struct cims_arena {
+    struct arena_chunk *head;   /* chunk we currently bump in */
+    struct arena_chunk *tail;   /* oldest chunk, lets a reset splice the list in O(1) */
+    struct arena_chunk *large;  /* allocations bigger than a chunk, freed on reset */
+    size_t used;                /* bytes used in head */
+};
+
+/* recycled CIMS_ARENA_CHUNK_SIZE chunks of this thread */
+static __thread struct arena_chunk *chunk_cache;
+
+static struct arena_chunk *arena_chunk_get()
+{
+    struct arena_chunk *chunk = chunk_cache;
+
+    if (NULL != chunk) {
+        chunk_cache = chunk->next;
+    } else {
+        chunk = malloc(sizeof(struct arena_chunk) + CIMS_ARENA_CHUNK_SIZE);
+        cims_assert(NULL != chunk, "out of memory");
+        chunk->size = CIMS_ARENA_CHUNK_SIZE;
+    }
+
+    chunk->next = NULL;
+    return chunk;
+}
+
+Cims_Arena core_cims_arena_create()
+{
+    Cims_Arena arena = core_cims_calloc(1, sizeof(struct cims_arena));
+
+    arena->head = arena->tail = arena_chunk_get();
+
+    return arena;
+}
+
+void *core_cims_arena_alloc(Cims_Arena arena, size_t size)
+{
+    size_t offset = (arena->used + CIMS_ARENA_ALIGN - 1) & ~(size_t)(CIMS_ARENA_ALIGN - 1);
+    struct arena_chunk *chunk;
+
+    /* written so that neither side can overflow */
+    if (offset <= arena->head->size && size <= arena->head->size - offset) {
+        arena->used = offset + size;
+        return arena->head->data + offset;
+    }
+
+    if (size > CIMS_ARENA_CHUNK_SIZE / 2) {
+        /* big buffers (E.g: a whole frame) get their own chunk, so the rest of
+         * the current one isn't wasted. Like malloc, impossible sizes fail
+         * */
+        if (size > SIZE_MAX - sizeof(struct arena_chunk)) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        if (NULL == (chunk = malloc(sizeof(struct arena_chunk) + size)))
+            return NULL;
+        chunk->size = size;
+        chunk->next = arena->large;
+        arena->large = chunk;
+
+        return chunk->data;
+    }
+
+    chunk = arena_chunk_get();
+    chunk->next = arena->head;
+    arena->head = chunk;
+    arena->used = size;
+
+    return chunk->data;
+}
+
+char *core_cims_arena_strdup(Cims_Arena arena, const char *s)
+{
+    size_t len = strlen(s) + NULL_TERM_SIZE;
+    char *copy = core_cims_arena_alloc(arena, len);
+
+    cims_assert(NULL != copy, "out of memory");
+    return memcpy(copy, s, len);
+}
+
+char *core_cims_arena_vprintf(Cims_Arena arena, const char *fmt, va_list args)
+{
+    va_list retry;
+    size_t offset = (arena->used + CIMS_ARENA_ALIGN - 1) & ~(size_t)(CIMS_ARENA_ALIGN - 1);
+    size_t room = offset < arena->head->size ? arena->head->size - offset : 0;
+    char *str = arena->head->data + offset;
+    int len;
+
+    /* format straight into the free space, most strings fit on the first try */
+    va_copy(retry, args);
+    len = vsnprintf(room ? str : NULL, room, fmt, args);
+    cims_assert(len >= 0, "invalid format \"%s\"", fmt);
+
+    if ((size_t) len < room) {
+        arena->used = offset + len + NULL_TERM_SIZE;
+    } else {
+        str = core_cims_arena_alloc(arena, len + NULL_TERM_SIZE);
+        cims_assert(NULL != str, "out of memory");
+        vsnprintf(str, len + NULL_TERM_SIZE, fmt, retry);
+    }
+    va_end(retry);
+
+    return str;
+}
+
+char *core_cims_arena_printf(Cims_Arena arena, const char *fmt, ...)
+{
+    va_list args;
+    char *str;
+
+    va_start(args, fmt);
+    str = core_cims_arena_vprintf(arena, fmt, args);
+    va_end(args);
+
+    return str;
+}
+
+void core_cims_arena_reset(Cims_Arena arena)
+{
+    struct arena_chunk *large = arena->large;
+
+    while (NULL != large) {
+        struct arena_chunk *next = large->next;
+        free(large);
+        large = next;
+    }
+    arena->large = NULL;
+
+    /* keep the newest chunk, everything older goes back to the cache at once */
+    if (arena->head != arena->tail) {
+        arena->tail->next = chunk_cache;
+        chunk_cache = arena->head->next;
+        arena->head->next = NULL;
+        arena->tail = arena->head;
+    }
+
+    arena->used = 0;
+}
+
+void core_cims_arena_destroy(Cims_Arena arena)
+{
+    core_cims_arena_reset(arena);
+
+    arena->head->next = chunk_cache;
+    chunk_cache = arena->head;
+
+    free(arena);
+}
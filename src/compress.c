@@ -0,0 +1,292 @@
+#include <CIMS/cims.h>
+#include <CIMS/compress.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+#define MIN_MATCH 4
+#define LAST_LITERALS 5     /* the stream always ends with a few literals */
+#define MAX_OFFSET 0xffff
+#define RUN_MASK 0x0f
+#define RAW_LEN_SIZE sizeof(uint32_t)
+
+/* static function declarations start */
+static uint32_t hash4(const uint8_t *p);
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len);
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len);
+static uint64_t cpu_clock();
+/* static function declarations end */
+
+/* The stream is a list of sequences (same layout as LZ4 blocks):
+ *
+ *  token          : high nibble literal count, low nibble match length - MIN_MATCH
+ *  [length bytes] : if a nibble is 15, bytes of 255 follow until one is < 255
+ *  literals
+ *  offset         : 2 bytes little endian, may reach back into the dictionary
+ *  [length bytes] : extended match length
+ *
+ * the last sequence only carries literals.
+ * */
+
+/* both sides pretend this text was sent right before every payload, so even
+ * short chat messages find matches
+ * */
+static const char dictionary[] =
+    "{\"type\":\"message\",\"from\":\"\",\"to\":\"\",\"group\":\"\",\"text\":\"\",\"timestamp\":"
+    "\"read\":true,\"delivered\":true,\"id\":\"},{\"history\":[ "
+    "https://www. .com/ .jpg .png "
+    "hello hi hey thanks thank you ok okay yes no sure sorry please lol haha :) :D "
+    "good morning good night see you later tomorrow today tonight what are you doing "
+    "how are you I'm fine I don't know I think that's great sounds good let me know "
+    "where are you when will you be here on my way I will call you back in a minute "
+    "did you see the message can you send me the file the meeting is at ";
+
+#define DICT_SIZE (sizeof(dictionary) - NULL_TERM_SIZE)
+
+struct payload {
+    Cims_Arena arena;
+    uint8_t *raw;
+    size_t raw_len;
+    uint8_t *packed;        /* raw length prefix + compressed stream */
+    size_t packed_len;
+    int tried;              /* compression is attempted only once */
+};
+
+static struct compress_stats stats;
+
+ssize_t cims_compress(Cims_Arena arena, const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    uint32_t table[HASH_SIZE] = {0}; /* window position + 1, 0 is empty */
+    size_t win_len = DICT_SIZE + len;
+    uint8_t *win;
+    uint8_t *op = dst, *oend = dst + cap;
+    size_t ip, anchor, limit;
+    uint64_t start = cpu_clock();
+
+    /* stays in the arena until it is reset, like the rest of the request */
+    if (len > SIZE_MAX - DICT_SIZE || NULL == (win = core_cims_arena_alloc(arena, win_len)))
+        return -1;
+
+    /* the window is the dictionary followed by the input, that way matches
+     * into the dictionary are just ordinary back references
+     * */
+    memcpy(win, dictionary, DICT_SIZE);
+    memcpy(win + DICT_SIZE, src, len);
+
+    for (size_t i = 0; i + MIN_MATCH <= DICT_SIZE; ++i)
+        table[hash4(win + i)] = i + 1;
+
+    ip = anchor = DICT_SIZE;
+    limit = win_len > LAST_LITERALS + MIN_MATCH ? win_len - LAST_LITERALS - MIN_MATCH : 0;
+
+    while (ip < limit && NULL != op) {
+        uint32_t h = hash4(win + ip);
+        size_t ref = table[h];
+
+        table[h] = ip + 1;
+
+        if (ref-- == 0 || ip - ref > MAX_OFFSET || memcmp(win + ref, win + ip, MIN_MATCH)) {
+            ip++;
+            continue;
+        }
+
+        size_t match_len = MIN_MATCH;
+        while (ip + match_len < win_len - LAST_LITERALS && win[ref + match_len] == win[ip + match_len])
+            match_len++;
+
+        op = put_sequence(op, oend, win + anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (NULL != op)
+        op = put_sequence(op, oend, win + anchor, win_len - anchor, 0, 0);
+
+    __atomic_fetch_add(&stats.calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bytes_in, len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.bytes_out, NULL != op ? op - dst : len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.cpu_nsec, cpu_clock() - start, __ATOMIC_RELAXED);
+
+    return NULL != op ? op - dst : -1;
+}
+
+ssize_t cims_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + len;
+    size_t op = 0;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        size_t match_len = token & RUN_MASK;
+        size_t offset;
+
+        if (lit_len == RUN_MASK) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 0xff);
+        }
+
+        if (lit_len > (size_t)(iend - ip) || lit_len > cap - op)
+            return -1;
+
+        memcpy(dst + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend)
+            break; /* last sequence */
+
+        if (iend - ip < 2)
+            return -1;
+
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (match_len == RUN_MASK) {
+            uint8_t b;
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 0xff);
+        }
+        match_len += MIN_MATCH;
+
+        if (offset == 0 || offset > op + DICT_SIZE || match_len > cap - op)
+            return -1;
+
+        /* byte wise on purpose, matches may overlap their own output */
+        for (size_t i = 0; i < match_len; ++i, ++op) {
+            dst[op] = offset > op ? (uint8_t) dictionary[DICT_SIZE + op - offset]
+                                  : dst[op - offset];
+        }
+    }
+
+    return op;
+}
+
+void cims_compress_stats(struct compress_stats *out)
+{
+    out->calls = __atomic_load_n(&stats.calls, __ATOMIC_RELAXED);
+    out->bytes_in = __atomic_load_n(&stats.bytes_in, __ATOMIC_RELAXED);
+    out->bytes_out = __atomic_load_n(&stats.bytes_out, __ATOMIC_RELAXED);
+    out->cpu_nsec = __atomic_load_n(&stats.cpu_nsec, __ATOMIC_RELAXED);
+}
+
+Payload payload_create(Cims_Arena arena, const void *data, size_t len)
+{
+    Payload payload = core_cims_arena_alloc(arena, sizeof(struct payload));
+
+    cims_assert(NULL != payload, "out of memory");
+    *payload = (struct payload) {
+        .arena      = arena,
+        .raw        = core_cims_arena_alloc(arena, len),
+        .raw_len    = len,
+    };
+    cims_assert(NULL != payload->raw, "out of memory");
+    memcpy(payload->raw, data, len);
+
+    return payload;
+}
+
+const void *payload_data(Payload payload, int allow_compressed, size_t *len, int *compressed)
+{
+    if (allow_compressed && !payload->tried && payload->raw_len >= CIMS_COMPRESS_MIN_SIZE) {
+        /* anything that doesn't fit into the raw size isn't worth sending */
+        size_t cap = payload->raw_len;
+        uint8_t *packed = core_cims_arena_alloc(payload->arena, RAW_LEN_SIZE + cap);
+        ssize_t packed_len = -1;
+
+        if (NULL != packed)
+            packed_len = cims_compress(payload->arena, payload->raw, payload->raw_len,
+                                       packed + RAW_LEN_SIZE, cap - RAW_LEN_SIZE);
+
+        /* a failed attempt stays in the arena until it is reset */
+        if (packed_len >= 0) {
+            *(uint32_t *) packed = htonl(payload->raw_len);
+            payload->packed = packed;
+            payload->packed_len = RAW_LEN_SIZE + packed_len;
+        }
+    }
+    payload->tried |= allow_compressed;
+
+    *compressed = allow_compressed && NULL != payload->packed;
+    *len = *compressed ? payload->packed_len : payload->raw_len;
+
+    return *compressed ? payload->packed : payload->raw;
+}
+
+static uint32_t hash4(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+    for (; len >= 0xff; len -= 0xff) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 0xff;
+    }
+
+    if (op >= oend)
+        return NULL;
+    *op++ = len;
+
+    return op;
+}
+
+/* a match_len of 0 marks the last, literal only sequence */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len)
+{
+    size_t ml_code = match_len ? match_len - MIN_MATCH : 0;
+
+    if (op >= oend)
+        return NULL;
+
+    *op++ = ((lit_len < RUN_MASK ? lit_len : RUN_MASK) << 4) | (ml_code < RUN_MASK ? ml_code : RUN_MASK);
+
+    if (lit_len >= RUN_MASK && NULL == (op = put_length(op, oend, lit_len - RUN_MASK)))
+        return NULL;
+
+    if (lit_len > (size_t)(oend - op))
+        return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0)
+        return op;
+
+    if (oend - op < 2)
+        return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    if (ml_code >= RUN_MASK && NULL == (op = put_length(op, oend, ml_code - RUN_MASK)))
+        return NULL;
+
+    return op;
+}
+
+static uint64_t cpu_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
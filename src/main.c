@@ -8,13 +8,9 @@ int main(int argc, char **argv)
     server = start_server(argc, argv);
     print_success(server);
 
-    while (1) {
-
-        Client_Info client;
-
-        client = accept_connection(server);
-        close_connection(client);
-    }
+    /* until SIGINT or SIGTERM */
+    while (serve_clients(server))
+        ;
 
     stop_server(server);
 
@@ -1,6 +1,11 @@
 
+#define _GNU_SOURCE /* accept4 */
 #include <CIMS/server.h>
 #include <CIMS/cims.h>
+#include <CIMS/trace.h>
+#include <CIMS/protocol.h>
+#include <CIMS/compress.h>
+#include <CIMS/attachment.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,10 +14,17 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <endian.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <net/if.h>
@@ -30,6 +42,7 @@
 #define PORT_FLAG 'p'
 #define DEVICE_FLAG 'd'
 #define EXPORT_FLAG 'e'
+#define TRACE_FLAG 't'
 
 #define ACTIVE 1
 #define INACTIVE !ACTIVE
@@ -45,11 +58,43 @@ struct server_info {
     struct sockaddr_in address;
     FILE *log_file;
     char *interface_name;
+    uint64_t conn_count;    /* connections accepted so far, used as trace id */
+    uint64_t msg_count;     /* frames received so far, used as message id */
+    size_t attachment_rate; /* download limit in bytes per second */
+    Cims_Arena arena;       /* request scoped memory, reset every loop iteration */
+    int data_fd;            /* CIMS_DATA_PATH */
+    struct timespec started;
+    uint64_t startup_usec;  /* start_server() until the socket listens */
+    Client_Info *clients;   /* everyone connected, all served from one poll */
+    size_t client_count;
+    size_t client_cap;
+    struct pollfd *pfds;    /* fd first, then one per client */
 };
 
 struct client_info {
     int fd;
+    uint64_t id;
+    int caps;           /* negotiated CIMS_CAP_* */
+    uint64_t trace_id;  /* message currently being handled */
+    Attachment_Transfer download;
+    Attachment_Transfer next_download; /* replaces download once its current frame is out */
+    Attachment_Transfer upload;
+    struct attach_range upload_range; /* host byte order, acked once the upload is stored */
+    size_t skip;        /* bytes of a rejected upload that are still to be dropped */
     struct sockaddr_in address;
+    uint8_t *rx;        /* read but not yet handled bytes */
+    size_t rx_len;
+    size_t rx_cap;
+    struct iovec tx[CIMS_TX_IOV_MAX]; /* replies of the current loop iteration */
+    int tx_count;
+    uint64_t tx_ids[CIMS_TX_IOV_MAX]; /* messages the queued frames belong to, for the trace */
+    int tx_id_count;
+    uint8_t *pending;   /* replies the socket didn't take yet, they go out first */
+    size_t pending_len;
+    size_t pending_cap;
+    int dead;           /* a flush in the middle of the round failed, closed at the end of it */
+    uint64_t frames;    /* frames handled, together with syscalls for the statistics */
+    uint64_t syscalls;
 };
 
 /* indeces for the flag- description pairs */
@@ -64,21 +109,52 @@ enum option_idx {
    PORT_IDX,
    DEVICE_IDX,
    EXPORT_IDX,
+   TRACE_IDX,
 };
 
+/* set by SIGINT/SIGTERM, the loop ends and stop_server() cleans up */
+static volatile sig_atomic_t stop_requested;
+
 /* static function declaration start */
 static void parse_args(Server_Info server, const int cnt, const char **v);
 static void parse_sys_env(Server_Info server);
 static int is_loopback(struct sockaddr *addr_p) _deprecated;
 static int is_ipv4(char *addr);
 static int is_valid_port(int port);
+static int is_valid_rate(char *str);
 static int is_valid_if_name(char *name);
-static int has_data_path();
 static int env_exported();
 static void list_options(struct option *options, int count);
 static void list_interfaces() _deprecated;
 static void set_cli_mode(Server_Info server);
+static void stop_signal_handler(int sig);
 static void send_msg(Server_Info server, Client_Info client, char *message);
+static void send_frame(Server_Info server, Client_Info client, int type, int flags, const void *data, size_t len);
+static void queue_frame(Server_Info server, Client_Info client, uint64_t id, int type, int flags,
+                        const void *data, size_t len);
+static void send_payload(Server_Info server, Client_Info client, uint64_t id, int type, Payload payload);
+static void send_error(Server_Info server, Client_Info client, char *reason);
+static void handshake(Server_Info server, Client_Info client);
+static void accept_connections(Server_Info server);
+static void add_client(Server_Info server, int fd, struct sockaddr_in *address);
+static void close_connection(Server_Info server, Client_Info client);
+static short poll_events(Client_Info client, int *timeout);
+static int serve_client(Server_Info server, Client_Info client, short revents);
+static int flush_frames(Server_Info server, Client_Info client);
+static int keep_pending(Server_Info server, Client_Info client, struct iovec *iov, int count);
+static int pump_download(Server_Info server, Client_Info client);
+static int continue_upload(Server_Info server, Client_Info client);
+static void finish_upload(Server_Info server, Client_Info client);
+static int read_frames(Server_Info server, Client_Info client);
+static ssize_t parse_attach_range(struct frame_header *hdr, uint8_t *body, size_t avail,
+                                  struct attach_range *range, char *name);
+static int handle_frame(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body);
+static int handle_batch(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body);
+static int handle_hello(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body);
+static int handle_msg(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body);
+static ssize_t handle_attach_put(Server_Info server, Client_Info client, struct frame_header *hdr,
+                                 uint8_t *buf, size_t avail);
+static int handle_attach_get(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body);
 static void server_log(Server_Info server, char *str);
 static void server_log_fmt(Server_Info server, char *fmt, ...) _printf(2, 3);
 static void server_error(Server_Info, char *str);
@@ -88,17 +164,23 @@ static void server_error_fmt(Server_Info server, char *fmt, ...) _printf(2, 3);
 Server_Info start_server(int c, char **v)
 {
     Server_Info server = core_cims_calloc(1, sizeof(struct server_info));
+    struct timespec listening;
+
+    clock_gettime(CLOCK_MONOTONIC, &server->started);
+    server->arena = core_cims_arena_create();
 
     if (!env_exported()) {
         /* equal to '$ CIMS_Server -export_env' */
         cims_export_env();
     }
 
-    if (!has_data_path()) {
-        cims_create_data_path(get_program_stat(v));
-    }
+    /* O(1) for an initialized store. Nothing is walked or indexed, attachments
+     * are looked up with openat() when they are requested
+     * */
+    server->data_fd = cims_open_data_path(v);
 
-    server->fd = socket(AF_INET, SOCK_STREAM, 0);
+    /* nothing blocks, every client is served from the same poll() */
+    server->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     ASSERT_RC(server->fd);
 
     cims_open_logfile(&server->log_file);
@@ -120,48 +202,215 @@ Server_Info start_server(int c, char **v)
     server->backlog = CIMS_BACKLOG;
     server->mode = GFX_MODE; /* default to gfx mode */
     server->verbose_log = INACTIVE;
+    server->attachment_rate = CIMS_ATTACHMENT_RATE;
+    server->pfds = core_cims_calloc(1, sizeof(struct pollfd));
 
     /* override with system values */
     parse_sys_env(server);
     /* override with user submitted values */
     parse_args(server, c, v);
 
+    /* a client hanging up mid write is handled where the write fails */
+    signal(SIGPIPE, SIG_IGN);
+
+    {
+        /* no SA_RESTART, poll() has to return so the loop sees the request */
+        struct sigaction sa = { .sa_handler = stop_signal_handler };
+
+        sigemptyset(&sa.sa_mask);
+        ASSERT_SYSCALL(sigaction(SIGINT, &sa, NULL));
+        ASSERT_SYSCALL(sigaction(SIGTERM, &sa, NULL));
+    }
+
     ASSERT_SYSCALL(setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, (void *) &(int) { 1 }, sizeof(int)));
     ASSERT_SYSCALL(bind(server->fd, (SA *)&(server->address), sizeof(server->address)));
     ASSERT_SYSCALL(listen(server->fd, server->backlog));
 
+    clock_gettime(CLOCK_MONOTONIC, &listening);
+    server->startup_usec = (listening.tv_sec - server->started.tv_sec) * 1000000ull
+                         + (listening.tv_nsec - server->started.tv_nsec) / 1000;
+
     return server;
 }
 
-Client_Info accept_connection(Server_Info server)
+int serve_clients(Server_Info server)
 {
-    Client_Info client = calloc(1, sizeof(struct client_info));
+    size_t count = server->client_count;
+    size_t alive = 0;
+    int timeout = -1;
 
-    client->fd = accept(server->fd, (SA *)&client->address, &(socklen_t) { sizeof(client->address) });
-    {
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(client->address.sin_addr.s_addr), ip, INET_ADDRSTRLEN);
-        server_log_fmt(server, "connection from %s", ip);
-        printf("connection!");
-        send_msg(server, client, "connection successful!");
+    if (stop_requested)
+        return FALSE;
+
+    /* a dump request interrupts poll(), but is picked up on any round */
+    cims_trace_poll();
+
+    core_cims_arena_reset(server->arena);
+
+    server->pfds[0] = (struct pollfd) { .fd = server->fd, .events = POLLIN };
+    for (size_t i = 0; i < count; ++i) {
+        Client_Info client = server->clients[i];
+
+        server->pfds[i + 1] = (struct pollfd) {
+            .fd     = client->fd,
+            .events = poll_events(client, &timeout),
+        };
+    }
+
+    if (poll(server->pfds, count + 1, timeout) < 0) {
+        if (errno != EINTR)
+            server_error_fmt(server, "poll failed: %s", strerror(errno));
+        return !stop_requested;
     }
 
-    ASSERT_RC(client->fd);
+    /* every client gets its turn, a slow one can't hold up the others */
+    for (size_t i = 0; i < count; ++i) {
+        Client_Info client = server->clients[i];
 
-    return client;
+        if (client->dead || !serve_client(server, client, server->pfds[i + 1].revents)) {
+            close_connection(server, client);
+            server->clients[i] = NULL;
+        }
+    }
+
+    /* messages for clients that were served before the sender, the arena
+     * they point into is reset with the next round
+     * */
+    for (size_t i = 0; i < count; ++i) {
+        Client_Info client = server->clients[i];
+
+        if (NULL == client)
+            continue;
+
+        if (flush_frames(server, client))
+            server->clients[alive++] = client;
+        else
+            close_connection(server, client);
+    }
+    server->client_count = alive;
+
+    if (server->pfds[0].revents & POLLIN)
+        accept_connections(server);
+
+    return !stop_requested;
+}
+
+static void accept_connections(Server_Info server)
+{
+    for (;;) {
+        struct sockaddr_in address;
+        int fd = accept4(server->fd, (SA *)&address, &(socklen_t) { sizeof(address) },
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0 && errno == EINTR)
+            continue;
+
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                server_error_fmt(server, "accept failed: %s", strerror(errno));
+            return;
+        }
+
+        add_client(server, fd, &address);
+    }
 }
 
-void close_connection(Client_Info client)
+static void add_client(Server_Info server, int fd, struct sockaddr_in *address)
 {
+    Client_Info client = core_cims_calloc(1, sizeof(struct client_info));
+    char ip[INET_ADDRSTRLEN];
+
+    client->fd = fd;
+    client->address = *address;
+    /* flush_frames already coalesces a round into one write, Nagle would only
+     * hold back its tail until the peer's delayed ack
+     * */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &(int) { 1 }, sizeof(int));
+    client->id = ++server->conn_count;
+    client->rx_cap = CIMS_RX_BUFFER_SIZE;
+    client->rx = malloc(client->rx_cap);
+    cims_assert(NULL != client->rx, "out of memory");
+
+    if (server->client_count == server->client_cap) {
+        server->client_cap = server->client_cap ? server->client_cap * 2 : 16;
+        server->clients = realloc(server->clients, server->client_cap * sizeof(Client_Info));
+        server->pfds = realloc(server->pfds, (server->client_cap + 1) * sizeof(struct pollfd));
+        cims_assert(NULL != server->clients && NULL != server->pfds, "out of memory");
+    }
+
+    cims_trace_begin(TRACE_ACCEPT, client->id);
+    inet_ntop(AF_INET, &(client->address.sin_addr.s_addr), ip, INET_ADDRSTRLEN);
+    server_log_fmt(server, "connection from %s", ip);
+    printf("connection!");
+    handshake(server, client);
+    cims_trace_end(TRACE_ACCEPT, client->id);
+
+    if (!flush_frames(server, client)) {
+        close_connection(server, client);
+        return;
+    }
+
+    server->clients[server->client_count++] = client;
+}
+
+static void close_connection(Server_Info server, Client_Info client)
+{
+    server_log_fmt(server, "client %llu: %llu frames in %llu syscalls",
+                   (unsigned long long) client->id, (unsigned long long) client->frames,
+                   (unsigned long long) client->syscalls);
+
+    if (NULL != client->download)
+        attachment_close(client->download);
+    if (NULL != client->next_download)
+        attachment_close(client->next_download);
+    if (NULL != client->upload)
+        attachment_close(client->upload);
     close(client->fd);
+    free(client->rx);
+    free(client->pending);
     free(client);
 }
+
+void broadcast_msg(Server_Info server, Client_Info sender, const void *msg, size_t len)
+{
+    /* the payload caches its compressed form, so fan-out compresses once */
+    Payload payload = payload_create(server->arena, msg, len);
+
+    /* only queued, everything goes out with the flush at the end of the round */
+    for (size_t i = 0; i < server->client_count; ++i) {
+        Client_Info client = server->clients[i];
+
+        if (NULL != client && client != sender)
+            send_payload(server, client, NULL != sender ? sender->trace_id : 0, FRAME_MSG, payload);
+    }
+}
+
 void stop_server(Server_Info server)
 {
+    struct compress_stats cs;
+
     server_log(server, "shutting down...");
+
+    for (size_t i = 0; i < server->client_count; ++i)
+        close_connection(server, server->clients[i]);
+
+    cims_compress_stats(&cs);
+    if (cs.calls > 0) {
+        server_log_fmt(server, "compressed %llu -> %llu bytes (ratio %.2f) in %llu calls, %llu us cpu",
+                       (unsigned long long) cs.bytes_in, (unsigned long long) cs.bytes_out,
+                       (double) cs.bytes_in / (cs.bytes_out ? cs.bytes_out : 1),
+                       (unsigned long long) cs.calls, (unsigned long long) cs.cpu_nsec / 1000);
+    }
+
+    if (cims_trace_active)
+        cims_trace_dump();
+    close(server->data_fd);
     close(server->fd);
     fclose(server->log_file);
     free(server->interface_name);
+    free(server->clients);
+    free(server->pfds);
+    core_cims_arena_destroy(server->arena);
     free(server);
 }
 
@@ -169,6 +418,7 @@ void print_success(Server_Info server)
 {
     server_log_fmt(server, "server running on %s:%d", inet_ntoa(server->address.sin_addr),
                 ntohs(server->address.sin_port));
+    server_log_fmt(server, "startup took %llu us", (unsigned long long) server->startup_usec);
 }
 
 static void parse_sys_env(Server_Info server)
@@ -193,6 +443,12 @@ static void parse_sys_env(Server_Info server)
         server->interface_name = env_value;
     }
 
+    if (NULL != (env_value = getenv(STRING_SYMBOL(CIMS_ATTACHMENT_RATE)))) {
+        /* 0 turns the limit off */
+        cims_assert(is_valid_rate(env_value), "%s is not a valid attachment rate", env_value);
+        server->attachment_rate = strtoull(env_value, NULL, 10);
+    }
+
 }
 
 static int is_valid_if_name(char *if_name_str)
@@ -234,6 +490,7 @@ static void parse_args(Server_Info server, const int cnt, const char **v)
             [PORT_IDX]      = { "port",       required_argument,    0,      PORT_FLAG },
             [DEVICE_IDX]    = { "device",     required_argument,    0,      DEVICE_FLAG },
             [EXPORT_IDX]    = { "export_env", no_argument,          0,      EXPORT_FLAG },
+            [TRACE_IDX]     = { "trace",      no_argument,          0,      TRACE_FLAG },
             { 0, 0, 0, 0 },
         };
 
@@ -282,6 +539,10 @@ static void parse_args(Server_Info server, const int cnt, const char **v)
     //        export_env();
             exit(EXIT_SUCCESS);
             break;
+        case TRACE_FLAG:
+            cims_trace_enable();
+            server_log_fmt(server, "flight recorder active, send signal %d to dump it", CIMS_TRACE_DUMP_SIGNAL);
+            break;
         case '?':           // NORETURN
             if (cnt > option_index)
                 option_index++;
@@ -306,6 +567,7 @@ static void list_options(struct option *options, int count)
         [PORT_IDX]      = "specify a port on which the server listens",
         [DEVICE_IDX]    = "specify a network device on which the server listens",
         [EXPORT_IDX]    = "export only the environent variables for the system",
+        [TRACE_IDX]     = "record per message pipeline timings (dump with SIGUSR1)",
     };
 
 
@@ -326,14 +588,18 @@ static int is_valid_port(int port)
     return (port < 65535) && (port != 0);
 }
 
-static int has_data_path()
+/* bytes per second, digits only (strtoull() would take "-1" or "4M") */
+static int is_valid_rate(char *str)
 {
-    struct stat dps;
+    char *end;
 
-    if (stat(CIMS_DATA_PATH, &dps) < 0)
-        return !(errno == ENOENT);
+    if (str[0] < '0' || str[0] > '9')
+        return FALSE;
 
-    return true;
+    errno = 0;
+    strtoull(str, &end, 10);
+
+    return errno == 0 && *end == '\0';
 }
 
 static int env_exported()
@@ -356,16 +622,669 @@ static int is_ipv4(char *str)
     return inet_aton(str, &(struct in_addr) {0}) != 0;
 }
 
+static void stop_signal_handler(int sig)
+{
+    (void) sig;
+    stop_requested = TRUE;
+}
+
 static void set_cli_mode(Server_Info server)
 {
     server->mode = CLI_MODE;
     server_log_fmt(server, "set mode to: \t%s", STRING_SYMBOL(CLI_MODE));
 }
 
+/* raw bytes without a frame header, message has to stay valid until the next flush_frames() */
 static void send_msg(Server_Info server, Client_Info client, char *message)
 {
     server_log_fmt(server, "sending message:\"%s\"", message);
-    dprintf(client->fd, "%s", message);
+
+    if (client->dead)
+        return;
+
+    if (client->tx_count + 1 > CIMS_TX_IOV_MAX && !flush_frames(server, client)) {
+        client->dead = TRUE;
+        return;
+    }
+
+    client->tx[client->tx_count++] = (struct iovec) { message, strlen(message) };
+}
+
+/* only queues the frame, data has to stay valid until the next flush_frames() */
+static void send_frame(Server_Info server, Client_Info client, int type, int flags, const void *data, size_t len)
+{
+    queue_frame(server, client, client->trace_id, type, flags, data, len);
+}
+
+/* id is the message the frame is sent for, 0 if there is none */
+static void queue_frame(Server_Info server, Client_Info client, uint64_t id, int type, int flags,
+                        const void *data, size_t len)
+{
+    struct frame_header *hdr;
+
+    /* the stream already lost part of a frame, nothing after it can be sent */
+    if (client->dead)
+        return;
+
+    if (client->tx_count + 2 > CIMS_TX_IOV_MAX && !flush_frames(server, client)) {
+        client->dead = TRUE;
+        return;
+    }
+
+    hdr = core_cims_arena_alloc(server->arena, sizeof(*hdr));
+    *hdr = (struct frame_header) {
+        .length = htonl(len),
+        .type   = type,
+        .flags  = flags,
+    };
+
+    client->tx[client->tx_count++] = (struct iovec) { hdr, sizeof(*hdr) };
+    if (len > 0)
+        client->tx[client->tx_count++] = (struct iovec) { (void *) data, len };
+
+    /* several replies to the same message share one write event */
+    if (id && (client->tx_id_count == 0 || client->tx_ids[client->tx_id_count - 1] != id))
+        client->tx_ids[client->tx_id_count++] = id;
+}
+
+/* everything queued goes out with one writev, what the socket doesn't take
+ * is copied out of the arena and goes first next time
+ * */
+static int flush_frames(Server_Info server, Client_Info client)
+{
+    struct iovec iov[CIMS_TX_IOV_MAX + 1];
+    uint64_t ids[CIMS_TX_IOV_MAX];
+    int id_count = client->tx_id_count;
+    int count = 0;
+    int first = 0;
+    size_t done;
+    ssize_t rc;
+
+    if (client->dead)
+        return FALSE;
+
+    if (client->tx_count == 0 && client->pending_len == 0)
+        return TRUE;
+
+    memcpy(ids, client->tx_ids, id_count * sizeof(uint64_t));
+    client->tx_id_count = 0;
+
+    /* the frames can't be interleaved with a half sent ATTACH_DATA frame.
+     * They go out later with the pending bytes, untraced
+     * */
+    if (NULL != client->download && attachment_mid_frame(client->download)) {
+        count = client->tx_count;
+        client->tx_count = 0;
+        return keep_pending(server, client, client->tx, count);
+    }
+
+    if (client->pending_len > 0)
+        iov[count++] = (struct iovec) { client->pending, client->pending_len };
+
+    memcpy(iov + count, client->tx, client->tx_count * sizeof(struct iovec));
+    count += client->tx_count;
+    client->tx_count = 0;
+
+    /* one write event per message that has a frame in it, nested so every
+     * begin has its end in the same thread
+     * */
+    for (int i = 0; i < id_count; ++i)
+        cims_trace_begin(TRACE_WRITE, ids[i]);
+    do {
+        rc = writev(client->fd, iov, count);
+        client->syscalls++;
+    } while (rc < 0 && errno == EINTR);
+    for (int i = id_count; i-- > 0;)
+        cims_trace_end(TRACE_WRITE, ids[i]);
+
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        rc = 0;
+
+    if (rc < 0) {
+        server_error_fmt(server, "failed to send frames to client %llu: %s",
+                         (unsigned long long) client->id, strerror(errno));
+        return FALSE;
+    }
+
+    done = rc;
+
+    /* the pending bytes are always the first iovec */
+    if (client->pending_len > 0) {
+        size_t sent = done < client->pending_len ? done : client->pending_len;
+
+        client->pending_len -= sent;
+        memmove(client->pending, client->pending + sent, client->pending_len);
+        done -= sent;
+        first = 1;
+    }
+
+    /* short write, keep what the socket stopped at */
+    for (; first < count && done >= iov[first].iov_len; ++first)
+        done -= iov[first].iov_len;
+
+    if (first < count) {
+        iov[first].iov_base = (char *) iov[first].iov_base + done;
+        iov[first].iov_len -= done;
+    }
+
+    return keep_pending(server, client, iov + first, count - first);
+}
+
+/* a client that doesn't read its replies is dropped before it can eat up memory */
+static int keep_pending(Server_Info server, Client_Info client, struct iovec *iov, int count)
+{
+    size_t len = client->pending_len;
+
+    for (int i = 0; i < count; ++i)
+        len += iov[i].iov_len;
+
+    if (len > CIMS_TX_PENDING_MAX) {
+        server_error_fmt(server, "client %llu doesn't read its replies", (unsigned long long) client->id);
+        return FALSE;
+    }
+
+    if (len > client->pending_cap) {
+        client->pending_cap = len;
+        client->pending = realloc(client->pending, client->pending_cap);
+        cims_assert(NULL != client->pending, "out of memory");
+    }
+
+    for (int i = 0; i < count; ++i) {
+        memcpy(client->pending + client->pending_len, iov[i].iov_base, iov[i].iov_len);
+        client->pending_len += iov[i].iov_len;
+    }
+
+    return TRUE;
+}
+
+static void send_payload(Server_Info server, Client_Info client, uint64_t id, int type, Payload payload)
+{
+    const void *data;
+    size_t len;
+    int compressed;
+
+    data = payload_data(payload, client->caps & CIMS_CAP_COMPRESS, &len, &compressed);
+    queue_frame(server, client, id, type, compressed ? FRAME_COMPRESSED : 0, data, len);
+}
+
+static void send_error(Server_Info server, Client_Info client, char *reason)
+{
+    server_error_fmt(server, "client %llu: %s", (unsigned long long) client->id, reason);
+    send_frame(server, client, FRAME_ERROR, 0, reason, strlen(reason));
+}
+
+/* nothing is read here, the client answers with an ordinary HELLO frame
+ * whenever it likes. Until then (or forever, for old clients) caps stay 0
+ * */
+static void handshake(Server_Info server, Client_Info client)
+{
+    struct hello_payload *hello = core_cims_arena_alloc(server->arena, sizeof(*hello));
+
+    *hello = (struct hello_payload) {
+        .version    = htons(CIMS_PROTOCOL_VERSION),
+        .caps       = htons(CIMS_SERVER_CAPS),
+    };
+
+    client->caps = 0;
+    send_msg(server, client, CIMS_GREETING);
+    send_frame(server, client, FRAME_HELLO, 0, hello, sizeof(*hello));
+}
+
+/* what the client waits for, timeout is lowered to the next download chunk */
+static short poll_events(Client_Info client, int *timeout)
+{
+    short events = 0;
+    int wait;
+
+    /* back pressure, stop reading from a client that doesn't read its replies */
+    if (client->pending_len < CIMS_RX_BUFFER_SIZE)
+        events |= POLLIN;
+
+    if (client->pending_len > 0)
+        return events | POLLOUT;
+
+    if (NULL == client->download)
+        return events;
+
+    /* a running download only sleeps as long as its rate limit says */
+    if (0 == (wait = attachment_wait_ms(client->download)))
+        return events | POLLOUT;
+
+    if (*timeout < 0 || wait < *timeout)
+        *timeout = wait;
+
+    return events;
+}
+
+/* returns FALSE once the connection can't be used anymore */
+static int serve_client(Server_Info server, Client_Info client, short revents)
+{
+    if (revents)
+        client->syscalls++; /* the poll that woke us */
+
+    /* a half sent ATTACH_DATA frame has to be finished before anything else */
+    if (NULL != client->download && attachment_mid_frame(client->download) && !pump_download(server, client))
+        return FALSE;
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        /* the socket carries file data until the upload is complete */
+        if (NULL != client->upload) {
+            if (!continue_upload(server, client))
+                return FALSE;
+        } else if (!read_frames(server, client)) {
+            flush_frames(server, client); /* the reason, if there is one */
+            return FALSE;
+        }
+    }
+
+    if (!flush_frames(server, client))
+        return FALSE;
+
+    /* chat frames go first, the download gets at most one chunk per round */
+    if (NULL != client->download && client->pending_len == 0 && !pump_download(server, client))
+        return FALSE;
+
+    return TRUE;
+}
+
+static int pump_download(Server_Info server, Client_Info client)
+{
+    client->syscalls++;
+    if (attachment_pump(client->download, client->fd) < 0) {
+        server_error_fmt(server, "download to client %llu failed: %s",
+                         (unsigned long long) client->id, strerror(errno));
+        return FALSE;
+    }
+
+    /* a replaced download is only dropped at a frame boundary */
+    if (attachment_done(client->download)
+        || (NULL != client->next_download && !attachment_mid_frame(client->download))) {
+        attachment_close(client->download);
+        client->download = client->next_download;
+        client->next_download = NULL;
+    }
+
+    return TRUE;
+}
+
+static int continue_upload(Server_Info server, Client_Info client)
+{
+    ssize_t rc;
+
+    cims_trace_begin(TRACE_PERSIST, client->trace_id);
+    rc = attachment_splice(client->upload, client->fd);
+    client->syscalls++;
+    cims_trace_end(TRACE_PERSIST, client->trace_id);
+
+    if (rc < 0) {
+        /* we can't tell how much of the chunk is still in the socket */
+        server_error_fmt(server, "storing an attachment of client %llu failed: %s",
+                         (unsigned long long) client->id, strerror(errno));
+        send_error(server, client, "attachment upload failed");
+        flush_frames(server, client);
+        return FALSE;
+    }
+
+    if (attachment_done(client->upload))
+        finish_upload(server, client);
+
+    return TRUE;
+}
+
+static void finish_upload(Server_Info server, Client_Info client)
+{
+    struct attach_range *range = core_cims_arena_alloc(server->arena, sizeof(*range));
+
+    *range = (struct attach_range) {
+        .offset = htobe64(client->upload_range.offset),
+        .length = htobe64(client->upload_range.length),
+    };
+    send_frame(server, client, FRAME_ACK, 0, range, sizeof(*range));
+
+    attachment_close(client->upload);
+    client->upload = NULL;
+}
+
+/* one read per loop iteration, every complete frame in it is handled right
+ * away. Returns FALSE once the connection can't be used anymore
+ * */
+static int read_frames(Server_Info server, Client_Info client)
+{
+    struct frame_header hdr;
+    size_t pos = 0;
+    ssize_t rc;
+
+    rc = read(client->fd, client->rx + client->rx_len, client->rx_cap - client->rx_len);
+    client->syscalls++;
+
+    if (rc < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return TRUE;
+
+    if (rc <= 0)
+        return FALSE; /* hung up */
+
+    client->rx_len += rc;
+
+    for (;;) {
+        uint8_t *body;
+        size_t avail;
+
+        /* the rest of a rejected upload, keeps the stream in sync */
+        if (client->skip > 0) {
+            size_t drop = client->rx_len - pos < client->skip ? client->rx_len - pos : client->skip;
+
+            pos += drop;
+            client->skip -= drop;
+        }
+
+        if (client->skip > 0 || client->rx_len - pos < sizeof(hdr))
+            break;
+
+        /* only now, the skip above may have moved pos */
+        body = client->rx + pos + sizeof(hdr);
+        avail = client->rx_len - pos - sizeof(hdr);
+        memcpy(&hdr, client->rx + pos, sizeof(hdr));
+        hdr.length = ntohl(hdr.length);
+
+        if (hdr.length > CIMS_MAX_FRAME_SIZE) {
+            send_error(server, client, "frame too large");
+            return FALSE;
+        }
+
+        if (hdr.type == FRAME_ATTACH_PUT) {
+            /* the file data isn't buffered, only what the read already got */
+            ssize_t used = handle_attach_put(server, client, &hdr, body, avail);
+
+            if (used < 0)
+                return FALSE;
+            if (used == 0)
+                break;
+
+            pos += sizeof(hdr) + used;
+
+            /* everything after this belongs to the upload */
+            if (NULL != client->upload)
+                break;
+            continue;
+        }
+
+        if (avail < hdr.length)
+            break;
+
+        if (!handle_frame(server, client, &hdr, body))
+            return FALSE;
+
+        pos += sizeof(hdr) + hdr.length;
+    }
+
+    client->rx_len -= pos;
+    memmove(client->rx, client->rx + pos, client->rx_len);
+
+    /* make room for a frame larger than the buffer */
+    if (client->rx_len >= sizeof(hdr)) {
+        size_t need;
+
+        memcpy(&hdr, client->rx, sizeof(hdr));
+        need = sizeof(hdr) + ntohl(hdr.length);
+
+        if (hdr.type != FRAME_ATTACH_PUT && need > client->rx_cap) {
+            client->rx_cap = need;
+            client->rx = realloc(client->rx, client->rx_cap);
+            cims_assert(NULL != client->rx, "out of memory");
+        }
+    }
+
+    return TRUE;
+}
+
+/* returns the bytes of range and name, 0 if they aren't complete yet and -1
+ * if they are malformed. name has to hold NAME_MAX + NULL_TERM_SIZE
+ * */
+static ssize_t parse_attach_range(struct frame_header *hdr, uint8_t *body, size_t avail,
+                                  struct attach_range *range, char *name)
+{
+    if (hdr->length < sizeof(*range))
+        return -1;
+
+    if (avail < sizeof(*range))
+        return 0;
+
+    memcpy(range, body, sizeof(*range));
+    range->offset = be64toh(range->offset);
+    range->length = be64toh(range->length);
+    range->name_len = ntohs(range->name_len);
+
+    if (range->name_len > NAME_MAX || hdr->length - sizeof(*range) < range->name_len)
+        return -1;
+
+    if (avail < sizeof(*range) + range->name_len)
+        return 0;
+
+    memcpy(name, body + sizeof(*range), range->name_len);
+    NULL_TERM_BUFF(name, range->name_len);
+
+    return sizeof(*range) + range->name_len;
+}
+
+/* returns FALSE once the connection can't be used anymore */
+static int handle_frame(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body)
+{
+    if (hdr->type == FRAME_BATCH)
+        return handle_batch(server, client, hdr, body);
+
+    if (hdr->type == FRAME_HELLO)
+        return handle_hello(server, client, hdr, body);
+
+    client->trace_id = ++server->msg_count;
+    client->frames++;
+
+    switch (hdr->type) {
+    case FRAME_MSG:
+        return handle_msg(server, client, hdr, body);
+    case FRAME_ATTACH_GET:
+        return handle_attach_get(server, client, hdr, body);
+    case FRAME_ACK:
+    case FRAME_RECEIPT:
+        /* there is nobody to forward them to yet */
+        cims_trace_begin(TRACE_ROUTE, client->trace_id);
+        cims_trace_end(TRACE_ROUTE, client->trace_id);
+        return TRUE;
+    default:
+        send_error(server, client, "unknown frame type");
+        return TRUE;
+    }
+}
+
+/* a batch is handled exactly like its frames sent back to back */
+static int handle_batch(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body)
+{
+    size_t pos = 0;
+
+    while (pos < hdr->length) {
+        struct frame_header inner;
+
+        if (hdr->length - pos < sizeof(inner)) {
+            send_error(server, client, "truncated batch");
+            return TRUE;
+        }
+
+        memcpy(&inner, body + pos, sizeof(inner));
+        inner.length = ntohl(inner.length);
+        pos += sizeof(inner);
+
+        if (inner.length > hdr->length - pos) {
+            send_error(server, client, "truncated batch");
+            return TRUE;
+        }
+
+        if (inner.type == FRAME_BATCH || inner.type == FRAME_ATTACH_PUT)
+            send_error(server, client, "frame type not allowed in a batch");
+        else if (!handle_frame(server, client, &inner, body + pos))
+            return FALSE;
+
+        pos += inner.length;
+    }
+
+    return TRUE;
+}
+
+static int handle_hello(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body)
+{
+    struct hello_payload hello;
+
+    if (hdr->length != sizeof(hello)) {
+        send_error(server, client, "malformed hello");
+        return TRUE;
+    }
+
+    memcpy(&hello, body, sizeof(hello));
+    client->caps = ntohs(hello.caps) & CIMS_SERVER_CAPS;
+    server_log_fmt(server, "client %llu negotiated capabilities 0x%x",
+                   (unsigned long long) client->id, client->caps);
+
+    return TRUE;
+}
+
+static int handle_msg(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body)
+{
+    uint8_t *msg = body;
+    size_t msg_len = hdr->length;
+    uint64_t *ack;
+
+    cims_trace_begin(TRACE_PARSE, client->trace_id);
+    if (hdr->flags & FRAME_COMPRESSED) {
+        uint32_t raw_len = 0;
+        ssize_t rc = -1;
+
+        if (hdr->length >= sizeof(raw_len)) {
+            memcpy(&raw_len, body, sizeof(raw_len));
+            raw_len = ntohl(raw_len);
+        }
+
+        if (hdr->length >= sizeof(raw_len) && raw_len <= CIMS_MAX_FRAME_SIZE
+            && NULL != (msg = core_cims_arena_alloc(server->arena, raw_len))) {
+            rc = cims_decompress(body + sizeof(raw_len), hdr->length - sizeof(raw_len), msg, raw_len);
+        }
+
+        if (rc != raw_len) {
+            cims_trace_end(TRACE_PARSE, client->trace_id);
+            send_error(server, client, "corrupt compressed payload");
+            return TRUE;
+        }
+
+        msg_len = raw_len;
+    }
+    cims_trace_end(TRACE_PARSE, client->trace_id);
+
+    cims_trace_begin(TRACE_ROUTE, client->trace_id);
+    server_log_fmt(server, "message %llu from client %llu (%zu bytes)",
+                   (unsigned long long) client->trace_id, (unsigned long long) client->id, msg_len);
+    broadcast_msg(server, client, msg, msg_len);
+    cims_trace_end(TRACE_ROUTE, client->trace_id);
+
+    ack = core_cims_arena_alloc(server->arena, sizeof(*ack));
+    *ack = htobe64(client->trace_id);
+    send_frame(server, client, FRAME_ACK, 0, ack, sizeof(*ack));
+
+    return TRUE;
+}
+
+/* returns the buffered bytes that were used up, 0 if range and name aren't
+ * complete yet or -1 if the connection is unusable. Data that isn't buffered
+ * yet is stored by continue_upload() as it arrives
+ * */
+static ssize_t handle_attach_put(Server_Info server, Client_Info client, struct frame_header *hdr,
+                                 uint8_t *buf, size_t avail)
+{
+    struct attach_range range;
+    char name[NAME_MAX + NULL_TERM_SIZE];
+    ssize_t head;
+    size_t buffered;
+
+    head = parse_attach_range(hdr, buf, avail, &range, name);
+
+    if (head == 0)
+        return 0;
+
+    if (head < 0 || range.length != hdr->length - head) {
+        send_error(server, client, "malformed attachment upload");
+        return -1;
+    }
+
+    client->trace_id = ++server->msg_count;
+    client->frames++;
+
+    buffered = avail - head < range.length ? avail - head : range.length;
+
+    if (!attachment_valid_name(name, range.name_len)) {
+        send_error(server, client, "invalid attachment name");
+        client->skip = range.length - buffered;
+        return head + buffered;
+    }
+
+    cims_trace_begin(TRACE_PERSIST, client->trace_id);
+    client->upload = attachment_create(name, range.offset, range.length);
+    if (NULL != client->upload && attachment_write(client->upload, buf + head, buffered) < 0) {
+        attachment_close(client->upload);
+        client->upload = NULL;
+    }
+    cims_trace_end(TRACE_PERSIST, client->trace_id);
+
+    if (NULL == client->upload) {
+        server_error_fmt(server, "storing attachment \"%s\" failed: %s", name, strerror(errno));
+        send_error(server, client, errno == EFBIG ? "attachment too large" : "attachment upload failed");
+        client->skip = range.length - buffered;
+        return head + buffered;
+    }
+
+    client->upload_range = range;
+    if (attachment_done(client->upload))
+        finish_upload(server, client);
+
+    return head + buffered;
+}
+
+static int handle_attach_get(Server_Info server, Client_Info client, struct frame_header *hdr, uint8_t *body)
+{
+    struct attach_range range;
+    char name[NAME_MAX + NULL_TERM_SIZE];
+    Attachment_Transfer download;
+
+    if (parse_attach_range(hdr, body, hdr->length, &range, name) <= 0) {
+        send_error(server, client, "malformed attachment request");
+        return TRUE;
+    }
+
+    if (!attachment_valid_name(name, range.name_len)) {
+        send_error(server, client, "invalid attachment name");
+        return TRUE;
+    }
+
+    if (NULL == (download = attachment_open(name, range.offset, range.length, server->attachment_rate))) {
+        server_error_fmt(server, "cannot open attachment \"%s\": %s", name, strerror(errno));
+        send_error(server, client, "attachment not available");
+        return TRUE; /* a running download goes on */
+    }
+
+    /* one download per connection, a new request replaces (E.g: resumes) the old one */
+    if (NULL != client->next_download) {
+        attachment_close(client->next_download);
+        client->next_download = NULL;
+    }
+
+    /* the header of a new ATTACH_DATA frame can't go into the middle of the
+     * old one, pump_download() swaps them once that frame is complete
+     * */
+    if (NULL != client->download && attachment_mid_frame(client->download)) {
+        client->next_download = download;
+        return TRUE;
+    }
+
+    if (NULL != client->download)
+        attachment_close(client->download);
+    client->download = download;
+
+    return TRUE;
 }
 
 static void server_error(Server_Info server, char *str)
@@ -380,10 +1299,10 @@ static void server_error_fmt(Server_Info server, char *fmt, ...)
     va_list args;
 
     va_start(args, fmt);
-    vasprintf(&str, fmt, args);
-    server_error(server, str);
+    str = core_cims_arena_vprintf(server->arena, fmt, args);
+    va_end(args);
 
-    free(str);
+    server_error(server, str);
 }
 
 static void server_log(Server_Info server, char *str)
@@ -400,9 +1319,9 @@ static void server_log_fmt(Server_Info server, char *fmt, ...)
     va_list args;
 
     va_start(args, fmt);
-    vasprintf(&str, fmt, args);
-    server_log(server, str);
+    str = core_cims_arena_vprintf(server->arena, fmt, args);
+    va_end(args);
 
-    free(str);
+    server_log(server, str);
 }
 
@@ -0,0 +1,193 @@
+#include <CIMS/cims.h>
+#include <CIMS/trace.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#define RING_MASK (CIMS_TRACE_RING_SIZE - 1)
+#define NSEC_PER_USEC 1000
+
+/* static function declarations start */
+static struct trace_ring *get_thread_ring();
+static uint64_t trace_clock();
+static void dump_signal_handler(int sig);
+/* static function declarations end */
+
+struct trace_event {
+    uint64_t ts;        /* CLOCK_MONOTONIC_RAW in ns */
+    uint64_t id;        /* connection for TRACE_ACCEPT, message for the other stages */
+    uint8_t stage;
+    uint8_t phase;
+};
+
+/* every thread writes into its own ring, so recording never takes a lock.
+ * The dumper reads the rings while they are written to, a torn event at the
+ * head is acceptable for a flight recorder.
+ * */
+struct trace_ring {
+    pid_t tid;
+    uint64_t head;      /* total events written, the slot is head & RING_MASK */
+    struct trace_event events[CIMS_TRACE_RING_SIZE];
+};
+
+static const char *stage_names[] = {
+    [TRACE_ACCEPT]  = "accept",
+    [TRACE_PARSE]   = "parse",
+    [TRACE_ROUTE]   = "route",
+    [TRACE_PERSIST] = "persist",
+    [TRACE_WRITE]   = "write",
+};
+
+/* connection and message ids are counted separately, the key tells them apart */
+static const char *id_names[] = {
+    [TRACE_ACCEPT]  = "conn",
+    [TRACE_PARSE]   = "msg",
+    [TRACE_ROUTE]   = "msg",
+    [TRACE_PERSIST] = "msg",
+    [TRACE_WRITE]   = "msg",
+};
+
+int cims_trace_active = FALSE;
+
+static struct trace_ring *rings[CIMS_TRACE_MAX_THREADS];
+static int ring_count;
+static unsigned int dump_count;
+static volatile sig_atomic_t dump_requested;
+
+static __thread struct trace_ring *thread_ring;
+static __thread int thread_untraced; /* set once we ran out of ring slots */
+
+void impl_cims_trace(enum trace_stage stage, enum trace_phase phase, uint64_t id)
+{
+    struct trace_ring *ring = get_thread_ring();
+    struct trace_event *ev;
+
+    if (NULL == ring)
+        return;
+
+    ev = &ring->events[ring->head & RING_MASK];
+    ev->ts = trace_clock();
+    ev->id = id;
+    ev->stage = stage;
+    ev->phase = phase;
+
+    /* publish the event only after it has been written */
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void cims_trace_enable()
+{
+    struct sigaction sa = {0};
+
+    /* no SA_RESTART: poll() has to return with EINTR so the main loop runs
+     * cims_trace_poll() and dumps right away instead of on the next event
+     * */
+    sa.sa_handler = dump_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    ASSERT_SYSCALL(sigaction(CIMS_TRACE_DUMP_SIGNAL, &sa, NULL));
+
+    cims_trace_active = TRUE;
+}
+
+int cims_trace_poll()
+{
+    if (!dump_requested)
+        return FALSE;
+
+    dump_requested = FALSE;
+    return cims_trace_dump();
+}
+
+int cims_trace_dump()
+{
+    char path[sizeof(CIMS_DATA_PATH) + 64];
+    FILE *out;
+    int count;
+    const char *sep = "";
+
+    snprintf(path, sizeof(path), CIMS_DATA_PATH CIMS_TRACE_FILE_FMT, getpid(), dump_count++);
+
+    if (NULL == (out = fopen(path, "w"))) {
+        fprintf(stderr, "[TRACE] cannot open \"%s\": %s\n", path, strerror(errno));
+        return FALSE;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count && i < CIMS_TRACE_MAX_THREADS; ++i) {
+        struct trace_ring *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        uint64_t head, tail;
+
+        if (NULL == ring)
+            continue;
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        tail = head > CIMS_TRACE_RING_SIZE ? head - CIMS_TRACE_RING_SIZE : 0;
+
+        for (uint64_t n = tail; n < head; ++n) {
+            struct trace_event *ev = &ring->events[n & RING_MASK];
+
+            if (ev->stage >= TRACE_STAGE_COUNT)
+                continue;
+
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"cims\",\"ph\":\"%c\","
+                         "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%llu}}",
+                    sep, stage_names[ev->stage], ev->phase,
+                    (unsigned long long) (ev->ts / NSEC_PER_USEC),
+                    (unsigned long long) (ev->ts % NSEC_PER_USEC),
+                    getpid(), ring->tid, id_names[ev->stage], (unsigned long long) ev->id);
+            sep = ",\n";
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    fprintf(stderr, "[TRACE] flight recorder dumped to \"%s\"\n", path);
+    return TRUE;
+}
+
+static struct trace_ring *get_thread_ring()
+{
+    int slot;
+
+    if (NULL != thread_ring || thread_untraced)
+        return thread_ring;
+
+    slot = __atomic_fetch_add(&ring_count, 1, __ATOMIC_ACQ_REL);
+    if (slot >= CIMS_TRACE_MAX_THREADS) {
+        thread_untraced = TRUE;
+        return NULL;
+    }
+
+    thread_ring = core_cims_calloc(1, sizeof(struct trace_ring));
+    thread_ring->tid = syscall(SYS_gettid);
+    __atomic_store_n(&rings[slot], thread_ring, __ATOMIC_RELEASE);
+
+    return thread_ring;
+}
+
+/* rdtsc would be cheaper but needs calibrating before it maps to the
+ * microseconds chrome traces want. CLOCK_MONOTONIC_RAW goes through the
+ * vDSO and is not skewed by NTP.
+ * */
+static uint64_t trace_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void dump_signal_handler(int sig)
+{
+    (void) sig;
+    dump_requested = TRUE;
+}